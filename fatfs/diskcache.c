@@ -0,0 +1,128 @@
+/*
+ * JPML's Polyphonic Music Library
+ * Developed for La Fortuna (at90usb1286) @ 8MHz
+ *
+ * sector cache between FatFs and the card driver; see diskcache.h.
+ * each line holds DISK_CACHE_LINE_SECTORS sectors starting at a multiple of DISK_CACHE_LINE_SECTORS, and the least recently
+ * used line is the one replaced. writes go straight through to the card (and into any line holding the same sector), so
+ * the cache never has anything the card doesn't. reads of more than one sector at once go straight to the card as well
+ */
+
+#include <string.h>
+#include "diskcache.h"
+
+#define SECTOR_SIZE 512
+
+#if DISK_CACHE_LINES
+struct CacheLine{
+	DWORD first; /*first sector in the line*/
+	uint8_t valid;
+} cache_lines[DISK_CACHE_LINES];
+BYTE cache_data[DISK_CACHE_LINES][DISK_CACHE_LINE_SECTORS * SECTOR_SIZE];
+uint8_t cache_order[DISK_CACHE_LINES]; /*line numbers, most recently used first*/
+DWORD cache_disk_sectors; /*size of the card, so a line is never read past its end; 0 if the driver couldn't say*/
+#endif
+uint32_t cache_hits = 0;
+uint32_t cache_misses = 0;
+
+#if DISK_CACHE_LINES
+/*forget everything cached, e.g. because the card might have changed*/
+static void cache_clear(void){
+	uint8_t i;
+	for(i=0; i<DISK_CACHE_LINES; i++){
+		cache_lines[i].valid = 0;
+		cache_order[i] = i;
+	}
+}
+
+/*make the line at position in cache_order the most recently used, and return its number*/
+static uint8_t cache_use(uint8_t position){
+	uint8_t line = cache_order[position];
+	memmove(cache_order+1, cache_order, position);
+	cache_order[0] = line;
+	return line;
+}
+
+/*position in cache_order of the line holding sector, or DISK_CACHE_LINES if it isn't cached*/
+static uint8_t cache_find(DWORD sector){
+	uint8_t i;
+	for(i=0; i<DISK_CACHE_LINES; i++){
+		struct CacheLine* line = &cache_lines[cache_order[i]];
+		if(line->valid && sector - line->first < DISK_CACHE_LINE_SECTORS) break;
+	}
+	return i;
+}
+
+/*read one sector through the cache*/
+static DRESULT cache_read(BYTE drv, BYTE* buff, DWORD sector){
+	uint8_t position = cache_find(sector);
+	uint8_t line;
+	DWORD first = sector - sector % DISK_CACHE_LINE_SECTORS;
+	if(position < DISK_CACHE_LINES){
+		cache_hits++;
+		line = cache_use(position);
+	}else{
+		cache_misses++;
+		if(cache_disk_sectors && first + DISK_CACHE_LINE_SECTORS > cache_disk_sectors) return drive_read(drv, buff, sector, 1); /*the last, partial line*/
+		line = cache_use(DISK_CACHE_LINES - 1); /*replace the least recently used line*/
+		cache_lines[line].valid = 0;
+		if(drive_read(drv, cache_data[line], first, DISK_CACHE_LINE_SECTORS) != RES_OK) return RES_ERROR;
+		cache_lines[line].first = first;
+		cache_lines[line].valid = 1;
+	}
+	memcpy(buff, cache_data[line] + (sector - cache_lines[line].first) * SECTOR_SIZE, SECTOR_SIZE);
+	return RES_OK;
+}
+#endif
+
+DSTATUS disk_initialize(BYTE drv){
+	DSTATUS status = drive_initialize(drv);
+#if DISK_CACHE_LINES
+	cache_clear();
+	if(status & STA_NOINIT || drive_ioctl(drv, GET_SECTOR_COUNT, &cache_disk_sectors) != RES_OK) cache_disk_sectors = 0;
+#endif
+	return status;
+}
+
+DSTATUS disk_status(BYTE drv){
+	return drive_status(drv);
+}
+
+DRESULT disk_read(BYTE drv, BYTE* buff, DWORD sector, UINT count){
+#if DISK_CACHE_LINES
+	if(count == 1 && !(drive_status(drv) & STA_NOINIT)) return cache_read(drv, buff, sector);
+#endif
+	return drive_read(drv, buff, sector, count);
+}
+
+DRESULT disk_write(BYTE drv, const BYTE* buff, DWORD sector, UINT count){
+	DRESULT result = drive_write(drv, buff, sector, count);
+#if DISK_CACHE_LINES
+	uint8_t i;
+	for(i=0; i<DISK_CACHE_LINES; i++){ /*keep any cached copies of the sectors the same as the card*/
+		struct CacheLine* line = &cache_lines[i];
+		DWORD s;
+		if(!line->valid) continue;
+		for(s=0; s<DISK_CACHE_LINE_SECTORS; s++){
+			if(line->first + s - sector >= count) continue;
+			if(result == RES_OK) memcpy(cache_data[i] + s * SECTOR_SIZE, buff + (line->first + s - sector) * SECTOR_SIZE, SECTOR_SIZE);
+			else line->valid = 0; /*don't know what the card holds now*/
+		}
+	}
+#endif
+	return result;
+}
+
+DRESULT disk_ioctl(BYTE drv, BYTE cmd, void* buff){
+	return drive_ioctl(drv, cmd, buff);
+}
+
+/*get the number of sectors read from the cache rather than the card*/
+uint32_t disk_cache_hits(void){
+	return cache_hits;
+}
+
+/*get the number of sectors that weren't in the cache when they were read*/
+uint32_t disk_cache_misses(void){
+	return cache_misses;
+}
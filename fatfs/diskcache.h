@@ -0,0 +1,44 @@
+/*
+ * JPML's Polyphonic Music Library
+ * Developed for La Fortuna (at90usb1286) @ 8MHz
+ *
+ * a small sector cache between FatFs and the SD card driver. with _FS_TINY, FatFs has one sector buffer for both file
+ * data and the FAT, so reading a song steadily asks the card for one sector at a time and reads the FAT sector again at
+ * every cluster. diskcache.c keeps the most recently used lines of DISK_CACHE_LINE_SECTORS consecutive sectors, and reads
+ * a whole line at once (a multiple block read on the card) when FatFs asks for a sector that isn't cached.
+ *
+ * the cache provides the disk_ functions FatFs calls (diskio.h), and the driver (sdmm.c on the La Fortuna, or
+ * tools/host/diskimage.c on the build machine) provides the same functions named drive_ instead
+ */
+
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include "diskio.h"
+
+/*lines of sectors kept (0 turns the cache off); set it with -DDISK_CACHE_LINES=n in CFLAGS.
+  the cache takes DISK_CACHE_LINES * DISK_CACHE_LINE_SECTORS * 512 bytes of RAM, 1KB by default (of the 8KB there is)*/
+#ifndef DISK_CACHE_LINES
+#define DISK_CACHE_LINES 1
+#endif
+
+/*consecutive sectors read into a line at once (1-8); more makes fewer, longer reads from the card*/
+#ifndef DISK_CACHE_LINE_SECTORS
+#define DISK_CACHE_LINE_SECTORS 2
+#endif
+
+#if DISK_CACHE_LINES > 255 || DISK_CACHE_LINE_SECTORS < 1 || DISK_CACHE_LINE_SECTORS > 8
+#error "DISK_CACHE_LINES must be at most 255, and DISK_CACHE_LINE_SECTORS 1-8"
+#endif
+
+uint32_t disk_cache_hits(void); /*number of sectors FatFs read that were already in the cache*/
+uint32_t disk_cache_misses(void); /*number of sectors FatFs read that had to be read from the card*/
+
+/*the driver underneath the cache*/
+DSTATUS drive_initialize(BYTE drv);
+DSTATUS drive_status(BYTE drv);
+DRESULT drive_read(BYTE drv, BYTE* buff, DWORD sector, UINT count);
+DRESULT drive_write(BYTE drv, const BYTE* buff, DWORD sector, UINT count);
+DRESULT drive_ioctl(BYTE drv, BYTE cmd, void* buff);
+
+#endif /* DISKCACHE_H */
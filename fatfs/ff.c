@@ -3989,6 +3989,112 @@ FRESULT f_forward (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Read File in Place in the Sector Buffer                               */
+/*-----------------------------------------------------------------------*/
+#if _USE_WINDOW
+/* Like f_read(), but rather than copying the data, *buff is pointed at it in
+/  the sector buffer, so no more than the rest of the current sector is read.
+/  With _FS_TINY the buffer is shared with the FAT and other files, so the data
+/  is only there while f_inwindow() is true; f_reload() brings it back. */
+
+FRESULT f_window (
+	FIL* fp, 		/* Pointer to the file object */
+	const BYTE** buff,	/* Pointer to the pointer to set to the data */
+	UINT btr,		/* Maximum number of bytes to read */
+	UINT* br		/* Pointer to number of bytes read */
+)
+{
+	FRESULT res;
+	DWORD clst, sect, remain;
+	UINT rcnt;
+	BYTE csect;
+
+
+	*br = 0;	/* Clear read byte counter */
+
+	res = validate(fp);							/* Check validity */
+	if (res != FR_OK) LEAVE_FF(fp->fs, res);
+	if (fp->err)								/* Check error */
+		LEAVE_FF(fp->fs, (FRESULT)fp->err);
+	if (!(fp->flag & FA_READ)) 					/* Check access mode */
+		LEAVE_FF(fp->fs, FR_DENIED);
+	remain = fp->fsize - fp->fptr;
+	if (btr > remain) btr = (UINT)remain;		/* Truncate btr by remaining bytes */
+	if (!btr) LEAVE_FF(fp->fs, FR_OK);
+
+	if ((fp->fptr % SS(fp->fs)) == 0) {			/* On the sector boundary? */
+		csect = (BYTE)(fp->fptr / SS(fp->fs) & (fp->fs->csize - 1));	/* Sector offset in the cluster */
+		if (!csect) {							/* On the cluster boundary? */
+			if (fp->fptr == 0) {				/* On the top of the file? */
+				clst = fp->sclust;				/* Follow from the origin */
+			} else {							/* Middle or end of the file */
+#if _USE_FASTSEEK
+				if (fp->cltbl)
+					clst = clmt_clust(fp, fp->fptr);	/* Get cluster# from the CLMT */
+				else
+#endif
+					clst = get_fat(fp->fs, fp->clust);	/* Follow cluster chain on the FAT */
+			}
+			if (clst < 2) ABORT(fp->fs, FR_INT_ERR);
+			if (clst == 0xFFFFFFFF) ABORT(fp->fs, FR_DISK_ERR);
+			fp->clust = clst;					/* Update current cluster */
+		}
+		sect = clust2sect(fp->fs, fp->clust);	/* Get current sector */
+		if (!sect) ABORT(fp->fs, FR_INT_ERR);
+		sect += csect;
+#if !_FS_TINY
+		if (fp->dsect != sect) {				/* Load data sector if not in cache */
+#if !_FS_READONLY
+			if (fp->flag & FA__DIRTY) {			/* Write-back dirty sector cache */
+				if (disk_write(fp->fs->drv, fp->buf, fp->dsect, 1) != RES_OK)
+					ABORT(fp->fs, FR_DISK_ERR);
+				fp->flag &= ~FA__DIRTY;
+			}
+#endif
+			if (disk_read(fp->fs->drv, fp->buf, sect, 1) != RES_OK)	/* Fill sector cache */
+				ABORT(fp->fs, FR_DISK_ERR);
+		}
+#endif
+		fp->dsect = sect;
+	}
+	rcnt = SS(fp->fs) - ((UINT)fp->fptr % SS(fp->fs));	/* Get partial sector data from sector buffer */
+	if (rcnt > btr) rcnt = btr;
+#if _FS_TINY
+	if (move_window(fp->fs, fp->dsect) != FR_OK)	/* Move sector window */
+		ABORT(fp->fs, FR_DISK_ERR);
+	*buff = &fp->fs->win[fp->fptr % SS(fp->fs)];
+#else
+	*buff = &fp->buf[fp->fptr % SS(fp->fs)];
+#endif
+	fp->fptr += rcnt;
+	*br = rcnt;
+
+	LEAVE_FF(fp->fs, FR_OK);
+}
+
+
+
+FRESULT f_reload (
+	FIL* fp 		/* Pointer to the file object */
+)
+{
+	FRESULT res;
+
+
+	res = validate(fp);							/* Check validity */
+	if (res != FR_OK) LEAVE_FF(fp->fs, res);
+#if _FS_TINY
+	if (move_window(fp->fs, fp->dsect) != FR_OK)	/* Move sector window back */
+		ABORT(fp->fs, FR_DISK_ERR);
+#endif
+
+	LEAVE_FF(fp->fs, FR_OK);
+}
+#endif /* _USE_WINDOW */
+
+
+
 #if _USE_MKFS && !_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* Create File System on the Drive                                       */
@@ -4323,8 +4429,13 @@ TCHAR* f_gets (
 {
 	int n = 0;
 	TCHAR c, *p = buff;
+#if _USE_WINDOW && !(_USE_LFN && _LFN_UNICODE)
+	const BYTE *wp;
+	UINT wc = 0;
+#else
 	BYTE s[2];
 	UINT rc;
+#endif
 
 
 	while (n < len - 1) {	/* Read characters until buffer gets filled */
@@ -4372,15 +4483,26 @@ TCHAR* f_gets (
 		if (!c) c = '?';
 #endif
 #else						/* Read a character without conversion */
+#if _USE_WINDOW
+		if (!wc) {					/* Take the rest of the sector in place */
+			if (f_window(fp, &wp, (UINT)(len - 1 - n), &wc) != FR_OK || !wc) break;
+		}
+		c = *wp++;
+		wc--;
+#else
 		f_read(fp, s, 1, &rc);
 		if (rc != 1) break;
 		c = s[0];
+#endif
 #endif
 		if (_USE_STRFUNC == 2 && c == '\r') continue;	/* Strip '\r' */
 		*p++ = c;
 		n++;
 		if (c == '\n') break;		/* Break on EOL */
 	}
+#if _USE_WINDOW && !(_USE_LFN && _LFN_UNICODE)
+	fp->fptr -= wc;				/* Give back what was taken but not used */
+#endif
 	*p = 0;
 	return n ? buff : 0;			/* When no data read (eof or error), return with error. */
 }
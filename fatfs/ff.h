@@ -208,6 +208,8 @@ FRESULT f_close (FIL* fp);											/* Close an open file object */
 FRESULT f_read (FIL* fp, void* buff, UINT btr, UINT* br);			/* Read data from a file */
 FRESULT f_write (FIL* fp, const void* buff, UINT btw, UINT* bw);	/* Write data to a file */
 FRESULT f_forward (FIL* fp, UINT(*func)(const BYTE*,UINT), UINT btf, UINT* bf);	/* Forward data to the stream */
+FRESULT f_window (FIL* fp, const BYTE** buff, UINT btr, UINT* br);	/* Read data from a file in place in the sector buffer */
+FRESULT f_reload (FIL* fp);											/* Bring the sector last read in place back into the sector buffer */
 FRESULT f_lseek (FIL* fp, DWORD ofs);								/* Move file pointer of a file object */
 FRESULT f_truncate (FIL* fp);										/* Truncate file */
 FRESULT f_sync (FIL* fp);											/* Flush cached data of a writing file */
@@ -238,6 +240,11 @@ TCHAR* f_gets (TCHAR* buff, int len, FIL* fp);						/* Get a string from the fil
 #define f_error(fp) ((fp)->err)
 #define f_tell(fp) ((fp)->fptr)
 #define f_size(fp) ((fp)->fsize)
+#if _FS_TINY
+#define f_inwindow(fp) ((fp)->fs->winsect == (fp)->dsect)	/* Whether data read in place is still in the sector buffer */
+#else
+#define f_inwindow(fp) 1
+#endif
 
 #ifndef EOF
 #define EOF (-1)
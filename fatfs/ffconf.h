@@ -47,7 +47,7 @@
 /  To enable it, also _FS_READONLY need to be set to 0. */
 
 
-#define	_USE_FASTSEEK	0
+#define	_USE_FASTSEEK	1
 /* This option switches fast seek feature. (0:Disable or 1:Enable) */
 
 
@@ -61,6 +61,11 @@
 /* To enable it, also _FS_TINY need to be set to 1. */
 
 
+#define	_USE_WINDOW		1
+/* This option switches f_window() and f_reload() functions, which read a file
+/  in place from the sector buffer rather than copying it. (0:Disable or 1:Enable) */
+
+
 /*---------------------------------------------------------------------------/
 / Locale and Namespace Configurations
 /---------------------------------------------------------------------------*/
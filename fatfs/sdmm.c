@@ -20,6 +20,8 @@
 
   * Low Speed
     The data transfer rate will be several times slower than hardware SPI.
+    Define SDMM_USE_SPI to drive the same pins (PB0-PB3) from the
+    AT90USB1286's SPI peripheral instead.
 
   * No Media Change Detection
     Application program needs to perform f_mount() after media change.
@@ -27,7 +29,7 @@
 /-------------------------------------------------------------------------*/
 
 
-#include "diskio.h"		/* Common include file for FatFs and disk I/O layer */
+#include "diskcache.h"	/* FatFs calls the disk_ functions in diskcache.c, which calls the drive_ ones here */
 
 
 /*-------------------------------------------------------------------------*/
@@ -41,6 +43,27 @@
 #define SDO		2
 #define SDI		3
 
+#ifdef SDMM_USE_SPI
+
+/* PB1-PB3 are SCK, MOSI and MISO of the SPI peripheral. PB0 is also its SS
+   pin, so keeping it an output (as CS) keeps the peripheral in master mode */
+
+#define DO_INIT()						/* MISO is an input while the SPI is master */
+
+#define DI_INIT()	DDRB  |= _BV(SDO)	/* Initialize port for MMC DI (MOSI) as output */
+
+#define CK_INIT()	DDRB  |= _BV(SCK)	/* Initialize port for MMC SCLK as output */
+#define	CK_L()		PORTB &= ~_BV(SCK)	/* Idle level of SCLK while the SPI is off */
+
+#define CS_INIT()	DDRB  |= _BV(SCS)	/* Initialize port for MMC CS as output */
+#define	CS_H()		PORTB |= _BV(SCS)	/* Set MMC CS "high" */
+#define CS_L()		PORTB &= ~_BV(SCS)	/* Set MMC CS "low" */
+
+#define	FCLK_SLOW()	(SPCR = _BV(SPE) | _BV(MSTR) | _BV(SPR1), SPSR = _BV(SPI2X))	/* F_CPU/32 (250kHz), under 400kHz for card identification */
+#define	FCLK_FAST()	(SPCR = _BV(SPE) | _BV(MSTR), SPSR = _BV(SPI2X))				/* F_CPU/2 (4MHz) once the card is ready */
+
+#else
+
 #define DO_INIT()						/* Initialize port for MMC DO as input */
 #define DO			(PINB &	_BV(SDI))	/* Test for MMC DO ('H':true, 'L':false) */
 
@@ -56,6 +79,11 @@
 #define	CS_H()		PORTB |= _BV(SCS)	/* Set MMC CS "high" */
 #define CS_L()		PORTB &= ~_BV(SCS)	/* Set MMC CS "low" */
 
+#define	FCLK_SLOW()	((void)0)
+#define	FCLK_FAST()	((void)0)
+
+#endif
+
 
 static
 void dly_us (UINT n)	/* Delay n microseconds (avr-gcc -Os) */
@@ -126,6 +154,60 @@ BYTE CardType;			/* b0:MMC, b1:SDv1, b2:SDv2, b3:Block addressing */
 
 
 
+#ifdef SDMM_USE_SPI
+
+/*-----------------------------------------------------------------------*/
+/* Transmit bytes to the card (SPI peripheral)                           */
+/*-----------------------------------------------------------------------*/
+
+static
+void xmit_mmc (
+	const BYTE* buff,	/* Data to be sent */
+	UINT bc				/* Number of bytes to send */
+)
+{
+	BYTE d;
+
+
+	SPDR = *buff++;			/* Start the first byte */
+	while (--bc) {
+		d = *buff++;		/* Fetch the next byte while this one is shifted out */
+		loop_until_bit_is_set(SPSR, SPIF);
+		SPDR = d;
+	}
+	loop_until_bit_is_set(SPSR, SPIF);
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Receive bytes from the card (SPI peripheral)                          */
+/*-----------------------------------------------------------------------*/
+
+static
+void rcvr_mmc (
+	BYTE *buff,	/* Pointer to read buffer */
+	UINT bc		/* Number of bytes to receive */
+)
+{
+	BYTE r;
+
+
+	SPDR = 0xFF;			/* Send 0xFF to clock in the first byte */
+	while (--bc) {
+		loop_until_bit_is_set(SPSR, SPIF);
+		r = SPDR;
+		SPDR = 0xFF;		/* Start the next byte before storing this one */
+		*buff++ = r;
+	}
+	loop_until_bit_is_set(SPSR, SPIF);
+	*buff = SPDR;
+}
+
+
+
+#else
+
 /*-----------------------------------------------------------------------*/
 /* Transmit bytes to the card (bitbanging)                               */
 /*-----------------------------------------------------------------------*/
@@ -198,6 +280,8 @@ void rcvr_mmc (
 	} while (--bc);
 }
 
+#endif
+
 
 
 /*-----------------------------------------------------------------------*/
@@ -375,7 +459,7 @@ BYTE send_cmd (		/* Returns command response (bit7==1:Send failed)*/
 /* Get Disk Status                                                       */
 /*-----------------------------------------------------------------------*/
 
-DSTATUS disk_status (
+DSTATUS drive_status (
 	BYTE drv			/* Drive number (always 0) */
 )
 {
@@ -390,7 +474,7 @@ DSTATUS disk_status (
 /* Initialize Disk Drive                                                 */
 /*-----------------------------------------------------------------------*/
 
-DSTATUS disk_initialize (
+DSTATUS drive_initialize (
 	BYTE drv		/* Physical drive nmuber (0) */
 )
 {
@@ -406,6 +490,7 @@ DSTATUS disk_initialize (
 	CK_INIT(); CK_L();		/* Initialize port pin tied to SCLK */
 	DI_INIT();				/* Initialize port pin tied to DI */
 	DO_INIT();				/* Initialize port pin tied to DO */
+	FCLK_SLOW();			/* Slow clock for the SPI peripheral, if used */
 
 	for (n = 10; n; n--) rcvr_mmc(buf, 1);	/* Apply 80 dummy clocks and the card gets ready to receive command */
 
@@ -438,6 +523,7 @@ DSTATUS disk_initialize (
 		}
 	}
 	CardType = ty;
+	if (ty) FCLK_FAST();	/* Full speed for data transfers */
 	s = ty ? 0 : STA_NOINIT;
 	Stat = s;
 
@@ -452,7 +538,7 @@ DSTATUS disk_initialize (
 /* Read Sector(s)                                                        */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_read (
+DRESULT drive_read (
 	BYTE drv,			/* Physical drive nmuber (0) */
 	BYTE *buff,			/* Pointer to the data buffer to store read data */
 	DWORD sector,		/* Start sector number (LBA) */
@@ -462,7 +548,7 @@ DRESULT disk_read (
 	BYTE cmd;
 
 
-	if (disk_status(drv) & STA_NOINIT) return RES_NOTRDY;
+	if (drive_status(drv) & STA_NOINIT) return RES_NOTRDY;
 	if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert LBA to byte address if needed */
 
 	cmd = count > 1 ? CMD18 : CMD17;			/*  READ_MULTIPLE_BLOCK : READ_SINGLE_BLOCK */
@@ -484,14 +570,14 @@ DRESULT disk_read (
 /* Write Sector(s)                                                       */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_write (
+DRESULT drive_write (
 	BYTE drv,			/* Physical drive nmuber (0) */
 	const BYTE *buff,	/* Pointer to the data to be written */
 	DWORD sector,		/* Start sector number (LBA) */
 	UINT count			/* Sector count (1..128) */
 )
 {
-	if (disk_status(drv) & STA_NOINIT) return RES_NOTRDY;
+	if (drive_status(drv) & STA_NOINIT) return RES_NOTRDY;
 	if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert LBA to byte address if needed */
 
 	if (count == 1) {	/* Single block write */
@@ -520,7 +606,7 @@ DRESULT disk_write (
 /* Miscellaneous Functions                                               */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_ioctl (
+DRESULT drive_ioctl (
 	BYTE drv,		/* Physical drive nmuber (0) */
 	BYTE ctrl,		/* Control code */
 	void *buff		/* Buffer to send/receive control data */
@@ -531,7 +617,7 @@ DRESULT disk_ioctl (
 	DWORD cs;
 
 
-	if (disk_status(drv) & STA_NOINIT) return RES_NOTRDY;	/* Check if card is in the socket */
+	if (drive_status(drv) & STA_NOINIT) return RES_NOTRDY;	/* Check if card is in the socket */
 
 	res = RES_ERROR;
 	switch (ctrl) {
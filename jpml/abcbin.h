@@ -0,0 +1,40 @@
+/*
+ * JPML's Polyphonic Music Library
+ * Developed for La Fortuna (at90usb1286) @ 8MHz
+ *
+ * A polyphonic synthesizer and abc player library by jpml1g14.
+ *
+ * abcbin.h describes the compiled song format: tools/abc2bin turns an abc file into one of these on the build machine,
+ * and abc_load_file() plays it without having to parse anything. it only needs stdint.h so the host-side compiler can include it too
+ */
+
+#ifndef _JPML_ABCBIN_H
+#define _JPML_ABCBIN_H
+
+#include <stdint.h>
+
+/* file layout (2-byte numbers are little-endian):
+ *	BIN_MAGIC | version (1 byte) | TICKS_PER_WHOLE (2 bytes) | tempo (2 bytes: beats per minute, or 0 to keep the current tempo) |
+ *	beat length (2 bytes, in ticks) | title (nul-terminated) | events
+ *
+ * numbers in the events are written 7 bits per byte, most significant first, with the top bit set on every byte but the last.
+ * every event starts with a delta time: the number of sequencer ticks since the previous event (or since the song started).
+ * then comes the event byte, and a number (its argument) after it:
+ *	0 to NOTES-1	play that note; the argument is its duration in ticks, as passed to channel_play()
+ *	BIN_WAVE	the argument is (channel << 4) | wave
+ *	BIN_VOICE	the argument is the voice number the following events belong to
+ *	BIN_TEMPO	the argument is the new length of a tick in timer 0 counts (TICK_LENGTH() in jpml.h), so it depends on F_CPU as well
+ *	BIN_END	no more events, and no argument; the song stops once the last notes have been released
+ * every event apart from BIN_END has exactly one argument, so a player can skip events it doesn't understand
+ */
+#define BIN_MAGIC "JPMB"
+#define BIN_MAGIC_SIZE 4
+#define BIN_VERSION 2
+#define BIN_TITLE_SIZE 64 /*longest title, including its nul; abc2bin cuts longer ones short*/
+
+#define BIN_WAVE 0xF0
+#define BIN_VOICE 0xF1
+#define BIN_TEMPO 0xF2
+#define BIN_END 0xFF
+
+#endif /* _JPML_ABCBIN_H */
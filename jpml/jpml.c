@@ -6,9 +6,11 @@
  *
  * Plays music from ABC notation files by generating mono PCM audio on pins OC3A (left audio channel) and OC1A (right audio channel)
  *
- * Waveform generation is done entirely on ISR1. 
- * ISR3 is used to increment the clock used for note on/off timing. 
- * ABC file parsing turned out to be too complex for an ISR, so unfortunately abc_play() blocks until the song is complete.
+ * Waveforms are rendered a block at a time by pwm_render() (which abc_poll() calls), and ISR1 just outputs the next sample of the current block. 
+ * ISR0 (timer 0 in CTC mode) marks each tick of the sequencer used for note on/off timing (TICKS_PER_WHOLE ticks to a whole note). 
+ * ABC file parsing turned out to be too complex for an ISR, so abc_poll() does it in between ticks, reading ahead into a queue of timestamped events;
+ * each tick then only has to play the events that are due, so a slow read doesn't hold up the notes.
+ * Songs can also be compiled on the build machine by tools/abc2bin (see abcbin.h), in which case each tick only has to read a few bytes per note.
  *
  * Built upon the LaFortuna WAV audio library by arp1g13:
  * 	github.com/fatcookies/lafortuna-wav-lib
@@ -21,47 +23,220 @@
  */
 
 #include "jpml.h"
+#include "abcbin.h"
 #include <stdint.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <string.h>
+#include <stdlib.h>
 
 /*
  * INTERNAL METHODS
  * method stubs omitted from jpml.h because there's no reason for them to be in the external API
  */
-uint32_t calculate_tempo_32nd(uint16_t bpm);
+uint16_t calculate_tick_length(uint16_t bpm, uint16_t beat_length);
+uint16_t position_tick_length(uint32_t position);
+void stop_ramp(uint32_t position);
+void set_tempo_beat(uint16_t bpm, uint16_t beat_length);
+void set_tick_length(uint16_t limit);
+uint16_t parse_tempo(char* tempostring);
+void body_field();
+void read_inline_field();
 uint8_t playNoteIfAvailable();
+void sequencer_init();
+void sequencer_stop();
+void sequencer_tick();
+uint32_t song_time();
+void render_block(volatile uint8_t* block);
+void mix_average(volatile uint8_t* block, uint16_t* mix, uint8_t polyphony);
+void mix_gain(volatile uint8_t* block, uint16_t* mix, uint8_t polyphony, int16_t gain);
+uint8_t steal_channel();
 void parse_lf_tag(char* tagstring);
-uint16_t string_to_note_length(char* str);
+uint16_t string_to_note_length(char* str, uint16_t unit);
+uint8_t bin_load_header();
+uint16_t bin_read_word();
+int16_t file_getc();
+int16_t file_peek();
+void next_char();
+uint8_t at_field_line();
+void read_field();
+void skip_line();
+void start_line();
+uint32_t bin_read_number();
+void bin_read_event();
+void read_notes();
+void read_tuplet();
+void read_bar();
+void skip_ending();
+void start_section();
+uint32_t char_offset();
+void seek_char(uint32_t offset);
+uint8_t find_voice(char* voicestring);
+uint8_t add_voice(char* voicestring);
+void find_voices(uint8_t body_voice);
+void start_voices(char* filename);
+void switch_voice(uint8_t v);
+uint8_t earliest_voice();
+void skip_voice();
+void end_voice();
+void end_tune(uint32_t offset);
+void play_on(uint8_t note, uint16_t duration, uint8_t channel);
+FRESULT load_song(char* filename, uint32_t offset);
+uint8_t index_read_sidecar(char* sidecar_name, FILINFO* info);
+void index_scan(char* sidecar_name, FILINFO* info);
+void index_sidecar_name(char* sidecar_name);
+struct ReaderState;
+void borrow_reader(struct ReaderState* saved);
+void return_reader(struct ReaderState* saved);
+void put_long(uint8_t* bytes, uint32_t number);
+void count_bar();
+void record_checkpoint();
+void seek_file(uint32_t offset);
+void use_link_map(FIL* file);
+uint32_t get_long(uint8_t* bytes);
+uint8_t read_ahead();
+void queue_event(uint8_t type, uint16_t argument);
 
-/* from experimentation, the la fortuna can handle a maximum of 3 sound channels reliably */
-#define CHANNELS 3 
-/* WARNING: the CHANNELS constant is only defined for readability purposes. 
-   changing this number will mess up other parts of the code 
-   (e.g. the line of code that obtains the lowest free channel is O(1) but only valid under the assumption that there are exactly 3 channels) */
+#if CHANNELS < 1 || CHANNELS > 8
+#error "CHANNELS must be between 1 and 8 (occupied_channels has one bit per channel)"
+#endif
+#define ALL_CHANNELS ((uint8_t)((1 << CHANNELS) - 1)) /*occupied_channels when every channel is playing*/
+#if VOICES < 1 || VOICES > 8
+#error "VOICES must be between 1 and 8"
+#endif
+#if CHECKPOINTS < 2 || CHECKPOINT_BARS < 1
+#error "there must be at least 2 CHECKPOINTS, at least 1 bar apart"
+#endif
+#if TUNE_INDEX_SIZE < 1 || TUNE_INDEX_SIZE > 255
+#error "TUNE_INDEX_SIZE must be between 1 and 255"
+#endif
+/*lookup table for 256-point sine wave*/
+const uint8_t sine[256] PROGMEM = {
+	128,131,134,137,140,143,146,149,
+	152,155,158,162,165,167,170,173,
+	176,179,182,185,188,190,193,196,
+	198,201,203,206,208,211,213,215,
+	218,220,222,224,226,228,230,232,
+	234,235,237,238,240,241,243,244,
+	245,246,248,249,250,250,251,252,
+	253,253,254,254,254,255,255,255,
+	255,255,255,255,254,254,254,253,
+	253,252,251,250,250,249,248,246,
+	245,244,243,241,240,238,237,235,
+	234,232,230,228,226,224,222,220,
+	218,215,213,211,208,206,203,201,
+	198,196,193,190,188,185,182,179,
+	176,173,170,167,165,162,158,155,
+	152,149,146,143,140,137,134,131,
+	128,124,121,118,115,112,109,106,
+	103,100,97,93,90,88,85,82,
+	79,76,73,70,67,65,62,59,
+	57,54,52,49,47,44,42,40,
+	37,35,33,31,29,27,25,23,
+	21,20,18,17,15,14,12,11,
+	10,9,7,6,5,5,4,3,
+	2,2,1,1,1,0,0,0,
+	0,0,0,0,1,1,1,2,
+	2,3,4,5,5,6,7,9,
+	10,11,12,14,15,17,18,20,
+	21,23,25,27,29,31,33,35,
+	37,40,42,44,47,49,52,54,
+	57,59,62,65,67,70,73,76,
+	79,82,85,88,90,93,97,100,
+	103,106,109,112,115,118,121,124,
+};
+
+#if MIXER != MIX_AVERAGE && MIXER != MIX_FIXED_GAIN && MIXER != MIX_RECIPROCAL
+#error "MIXER must be MIX_AVERAGE, MIX_FIXED_GAIN or MIX_RECIPROCAL"
+#endif
+#define MIX_GAIN (256 / CHANNELS) /*gain of each channel with MIX_FIXED_GAIN, in 1/256ths: the loudest possible chord just fits*/
+#if MIXER == MIX_RECIPROCAL || defined(JPML_BENCHMARK)
+/*256/n for n channels playing, so MIX_RECIPROCAL can average them without dividing*/
+static const int16_t mix_reciprocal[9] PROGMEM = {0, 256, 128, 85, 64, 51, 42, 36, 32}; /*rounded down so the sum can never overflow*/
+#endif
+/*index of the only set bit in an 8-bit mask*/
+#define bit_index(b) ((((b) & 0xF0) ? 4 : 0) | (((b) & 0xCC) ? 2 : 0) | (((b) & 0xAA) ? 1 : 0))
 
 struct Channel{
 	uint8_t note; /*either the index of the note in notes.h/note_step, or 255 if the note is off because 0xFF looks like the word OFF*/
+	uint16_t step; /*note_step for the note, copied out of flash when the note starts so rendering doesn't have to look it up*/
 	uint8_t wave; /*either SINE, TRIANGLE, SQUARE or SAWTOOTH (0-3 respectively)*/
 	uint16_t time_until_release; /*decremented at each tick of the sequencer; when it hits 0, the note stops playing*/
-	uint16_t tick; /*current x-position of the wave (loops from 0 to 512)*/
+	uint16_t phase; /*current x-position of the wave as a fraction of a cycle (wraps round from 65535 to 0)*/
+	uint16_t started; /*value of note_serial when the note started; used to work out which note is the oldest*/
 } channels[CHANNELS];
 
 
 /* wave variables */
 volatile uint8_t pwm_in_use = 0; /*flag*/
-volatile uint8_t tick_scaler = 0; /*used to throttle the speed of ISR1*/
-uint8_t occupied_channels = 0; /*each channel is a flag; hence 0x7 means all 3 channels are currently playing*/
+volatile uint8_t sample_blocks[2][SAMPLE_BLOCK_SIZE]; /*ping-pong buffer: ISR1 plays one block while pwm_render() fills the other*/
+volatile uint8_t block_full[2]; /*set by pwm_render() when a block has been filled; cleared by ISR1 when it has been played*/
+volatile uint8_t play_block = 0; /*block ISR1 is currently playing*/
+volatile uint8_t play_index = 0; /*position of the next sample in the current block*/
+volatile uint8_t sample_hold = PWM_OVERFLOWS_PER_SAMPLE; /*number of timer 1 overflows left until the next sample is output*/
+volatile uint16_t underruns = 0; /*number of samples ISR1 couldn't output because the block wasn't ready*/
+uint8_t last_sample = 0; /*last sample rendered; held when no notes are playing*/
+uint8_t occupied_channels = 0; /*each channel is a flag; hence ALL_CHANNELS (0x7 for 3 channels) means all channels are currently playing*/
+uint8_t steal_policy = STEAL_OLDEST; /*which note channel_play() replaces when all channels are playing*/
+uint16_t note_serial = 0; /*incremented every time a note starts (16 bits, so a note held while 65535 others start still looks the oldest)*/
+uint16_t notes_stolen = 0; /*number of notes cut short to make room for a new one*/
+uint16_t notes_dropped = 0; /*number of notes not played at all because there was no room for them*/
 
 /* sequencer variables */ 
-volatile uint32_t bpmCounter = 0; 
-uint32_t bpmLimit = 1708; /*how far bpmCounter should count before it counts as a tick (1708 = "Q:1/4=120" by default)*/
+volatile uint8_t tick_due = 0; /*set by ISR0 when the song clock reaches tick_time; cleared when abc_poll() notices*/
+volatile uint32_t song_clock = 0; /*number of timer 0 counts since the song started (up to the start of the current span)*/
+volatile uint32_t tick_time = 0; /*song time the next tick is due at. bpmLimit is added to it after every tick rather than resetting a counter, so no time is lost when a tick is late*/
+uint32_t lateness_total = 0; /*accumulated lateness of every tick so far, in timer 0 counts*/
+uint32_t lateness_max = 0; /*lateness of the latest tick so far, in timer 0 counts*/
+uint16_t bpmLimit = TICK_LENGTH(90, TICKS_PER_WHOLE / 4); /*how many timer 0 counts make up a tick ("Q:1/4=90" by default)*/
+uint16_t parse_tick_length = TICK_LENGTH(90, TICKS_PER_WHOLE / 4); /*bpmLimit as of parse_tick, i.e. once the notes read so far have been played*/
+/*abc_tempo_ramp() moves bpmLimit towards ramp_target by the same amount every tick, keeping it in 1/256ths of a count so no divide is needed per tick*/
+uint32_t ramp_length = 0; /*bpmLimit << 8, plus the fraction of a count*/
+int32_t ramp_step = 0; /*change in ramp_length every tick*/
+uint16_t ramp_target = 0; /*bpmLimit at the end of the ramp*/
+uint16_t ramp_ticks = 0; /*ticks left in the ramp; 0 when the tempo isn't ramping*/
+/* abc_seek_bar() has to know what tempo any bar is played at, so the last ramp is also kept by song position (see tick_base): it applies
+ * from where it started up to the first "Q:" change read after that (which stops it when it's played), or until the tempo is set
+ */
+uint32_t ramp_start_tick = 0; /*song position the ramp started at*/
+uint32_t ramp_start_length = 0; /*ramp_length then*/
+uint16_t ramp_total = 0; /*length of the whole ramp in ticks*/
+uint32_t ramp_stop_tick = 0; /*song position of the first tick the ramp doesn't apply to (ramp_start_tick if there's no ramp)*/
 uint8_t next_note;
-uint32_t length; /*length of the next note to play*/
-uint16_t time_until_next_note = 0; /*number of sequencer ticks before the next note is read and played*/
+uint32_t length; /*length of the next note to play, in ticks*/
+uint16_t time_until_next_note = 0; /*number of sequencer ticks between the note (or chord) being read and the next one*/
+int8_t broken_rhythm; /*number of '>'s after the next note (negative for '<'s); see playNoteIfAvailable()*/
+int8_t broken_rhythm_next = 0; /*broken_rhythm for the note after, which makes up the time the next note gains or loses*/
+uint8_t tuplet_notes = 0; /*number of notes (or chords) left in the current tuplet*/
+uint8_t tuplet_p, tuplet_q; /*notes in the current tuplet are played p in the time of q*/
+uint8_t tuplet_remainder = 0; /*what was left over from dividing the last note of the tuplet by tuplet_p; carried on to the next one*/
 int8_t accidental_shift; /*number of semitones to increase pitch of the next note by*/
 char numstring[16]; /*temporary variable to store a string of digits and slashes as they are being read in (used for note length modifiers)*/
-int8_t number_mode; /*temporary variable to store the index of the last digit seen in readlinebuffer*/
+int8_t number_mode; /*temporary variable to store the number of digits and slashes in numstring so far*/
+uint16_t idle_polls = 0; /*number of calls to abc_poll() since the last tick that had nothing to do*/
+uint16_t idle_polls_last_tick = 0; /*value of idle_polls when the last tick happened*/
+
+/* event queue: notes are read from the file ahead of time and wait here until the tick they're due at */
+#if EVENT_QUEUE_SIZE < 2*READ_AHEAD_ROOM || EVENT_QUEUE_SIZE > 128 || (EVENT_QUEUE_SIZE & (EVENT_QUEUE_SIZE - 1))
+#error "EVENT_QUEUE_SIZE must be a power of 2 from 16 to 128"
+#endif
+struct Event{
+	uint32_t tick; /*sequencer tick the event is due at*/
+	uint8_t type; /*a note to play (0 to NOTES-1), or BIN_WAVE or BIN_END as in compiled songs (see abcbin.h)*/
+	uint16_t argument; /*duration of a note in ticks, or (channel << 4) | wave*/
+	uint8_t voice; /*voice the event belongs to; its notes play on the channel of the same number if they can*/
+} event_queue[EVENT_QUEUE_SIZE];
+uint8_t queue_head = 0; /*index of the next event due*/
+uint8_t queue_length = 0; /*number of events waiting in the queue*/
+uint8_t queue_high_water = 0; /*most events there have been in the queue at once since the song was loaded*/
+uint16_t late_events = 0; /*number of events played after the tick they were due at, because they hadn't been read in time*/
+uint32_t song_tick = 0; /*number of sequencer ticks since the song started*/
+uint32_t parse_tick = 0; /*tick the next event read from the file is due at*/
+/* song positions count ticks from the start of the song as if it had been played straight through, so unlike song_tick and parse_tick
+ * they stay the same across abc_seek_bar(): a position is either of them plus tick_base
+ */
+uint32_t tick_base = 0;
+uint8_t reading_file = 0; /*set while there's still more of the file to read (by any voice)*/
 
 #define ABC_STOPPED 0
 #define ABC_PLAYING 1
@@ -69,30 +244,140 @@ int8_t number_mode; /*temporary variable to store the index of the last digit se
 uint8_t abc_playing = ABC_STOPPED; 
 /*abc_playing values:
  *	0 if stopped
- *	1 if playing and still reading from the file
- *	2 if finished reading from the file and the last notes are still playing
+ *	1 if playing and there are still notes to read from the file or play from the queue
+ *	2 if every note has been played and the last ones are still sounding
  */
 
 #define rest 128
 #define natural 64
 #define chord 32
+#define broken 16
 uint8_t note_flags = 0; 
-/*	set when the previous note is a rest, has a natural modifier, or is part of a chord. stored as follows:
-		x      x 		 x 		 xxxxx
-		rest | natural | chord | (unused)
+/*	set when the previous note is a rest, has a natural modifier, is part of a chord, or is followed by '<' or '>'. stored as follows:
+		x      x 		 x 		 x 		  xxxx
+		rest | natural | chord | broken | (unused)
 	use note_flags the same way you'd use pins
 */
 
 /* song information (from headers) */
 char* title; /*title of the current song*/
-uint16_t default_note_length = 8; /*base note length if not otherwise specified (1/4 note - eight 32nds - by default)*/
+uint16_t default_note_length = TICKS_PER_WHOLE / 4; /*base note length in ticks if not otherwise specified (1/4 note by default)*/
 uint8_t key_signature[7] = {A4, B4, C4, D4, E4, F4, G4}; /*key signature of the current song*/
 
 /* file io variables */
 FATFS fs; /*filesystem*/
-FIL file; /*current file*/
-volatile char* readlinebuffer = 0; /*current line of the file being read*/
-volatile uint16_t readline_index = 0; /*current position through readlinebuffer*/
+#define FORMAT_ABC 0
+#define FORMAT_BINARY 1
+#define HEADER_ABC 0 /*bin_load_header() results: an ordinary abc file,*/
+#define HEADER_COMPILED 1 /*a compiled song, ready to play,*/
+#define HEADER_UNSUPPORTED 2 /*or a song compiled for a different version of the player*/
+uint8_t song_format = FORMAT_ABC; /*whether the current file is abc text or a song compiled by abc2bin*/
+#define FILE_CHUNK_SIZE 32 /*number of bytes of the file copied at a time by a voice of a tune with several (see file_getc())*/
+int16_t current_char = -1; /*character of the abc file being read; '\0' just after the end of each line, and -1 at the end of the file*/
+#define FIELD_SIZE 64 /*longest header line (e.g. "T:title") that is kept; the rest of a longer line is ignored*/
+char field[FIELD_SIZE]; /*header line currently being read*/
+
+/* repeats: repeated sections are played again by seeking back to where they started, rather than by remembering their notes.
+ * abc repeats don't nest, so the only offset that needs to be kept is that of the start of the current section
+ */
+uint32_t repeat_start = 0; /*offset in the file of the first character of the section ":|" goes back to*/
+uint8_t repeat_pass = 0; /*0 the first time through the current section, 1 the second time*/
+uint8_t repeat_key[7]; /*key_signature at repeat_start, for an inline "[K:...]" in the section to be undone when it's played again*/
+uint16_t repeat_seeks = 0; /*number of times the file has been seeked back to the start of a section since the song was loaded*/
+uint32_t seek_time = 0; /*total time those seeks took, including reading from the new position, in timer 0 counts*/
+
+/* voices: each "V:" voice of a tune is read by its own reader, with its own cursor in the file and its own chunk of it, and the notes of
+ * whichever voice is furthest behind are read next so that the queue stays in order. the reader in use keeps its parser state in the
+ * variables above (current_char, parse_tick, key_signature, etc.), and switch_voice() swaps them with those of another voice.
+ * a tune without voices is read by voices[0] on its own
+ */
+#define VOICE_NAME_SIZE 8 /*longest voice name kept (including its nul); longer names only have to match this far*/
+struct Voice{
+	char name[VOICE_NAME_SIZE]; /*what follows "V:", up to the first space*/
+	FIL file; /*the voice's own cursor in the file*/
+	const BYTE* chunk; /*the bytes of the file the voice is currently reading: in place in fatfs's sector buffer, or copy*/
+	uint8_t copy[FILE_CHUNK_SIZE]; /*the chunk, when it has to be copied out (see file_getc())*/
+	uint16_t chunk_length; /*number of bytes in chunk*/
+	uint16_t chunk_index; /*position of the next byte in chunk*/
+	uint8_t reading; /*set while the voice still has more of the file to read*/
+	/*parser state; only kept here while the voice isn't the one being read*/
+	int16_t current_char;
+	uint32_t parse_tick;
+	int8_t broken_rhythm_next;
+	uint8_t tuplet_notes, tuplet_p, tuplet_q, tuplet_remainder;
+	uint32_t repeat_start;
+	uint8_t repeat_pass;
+	uint8_t repeat_key[7];
+	uint8_t key_signature[7];
+} voices[VOICES];
+uint8_t voice_count = 0; /*number of voices named in the tune (0 if it doesn't have any)*/
+struct Voice* reader = voices; /*voice being read from the file*/
+struct Voice* window_reader = 0; /*voice whose chunk is known to still be in fatfs's sector buffer (0 when something else may have used it)*/
+/*what abc_index_file() and abc_tune_title() borrow to read the abc file with voices[0], so that a song already loaded gets it back*/
+struct ReaderState{
+	struct Voice voice;
+	struct Voice* reader;
+	int16_t current_char;
+	uint32_t tune_end;
+	uint8_t voice_count;
+};
+uint8_t reading_voice = 0; /*index of reader in voices*/
+uint8_t event_voice = 0; /*voice the events being queued belong to: reading_voice, or the last BIN_VOICE of a compiled song*/
+uint32_t tune_end = 0xFFFFFFFF; /*offset of the "X:" line of the tune after the one being played; nothing from there on is read*/
+
+/* cluster link map of the song file, for FatFs's fast seek: where each fragment of the file is on the card, so a seek (for a repeat,
+ * a tune, a voice or abc_seek_bar()) goes straight to the right cluster instead of reading the FAT from the start of the file.
+ * it's made when a file is opened, and kept as long as the same file is opened again; every voice's cursor shares it
+ */
+DWORD link_map[SEEK_FRAGMENTS*2 + 2]; /*as f_lseek(CREATE_LINKMAP) makes it: its size, a length and first cluster per fragment, then 0*/
+DWORD link_map_cluster = 0; /*first cluster of the file link_map is for (0 if it isn't for one)*/
+DWORD link_map_size; /*and that file's size*/
+
+/* tune index: where each "X:" tune of a file starts, so that any of them can be loaded with a single seek. abc_index_file() reads
+ * the whole file to find them, then caches them in a sidecar file next to it (the same name with the extension .JPI), which is used
+ * instead as long as the abc file's size and modification time haven't changed. the sidecar file is:
+ *	INDEX_MAGIC | version (1 byte) | TUNE_INDEX_SIZE (1 byte) | size of the abc file (4 bytes) | its date and time (2 bytes each) |
+ *	number of tunes (1 byte) | one INDEX_RECORD_SIZE record per tune
+ * where each record is the offset of the tune's "X:" line (4 bytes), its number (2 bytes) and its title (nul-padded).
+ * every number is little-endian. the titles are only kept in the sidecar file, and read from it when they're asked for
+ */
+#define INDEX_MAGIC "JPMI"
+#define INDEX_MAGIC_SIZE 4
+#define INDEX_VERSION 1
+#define INDEX_HEADER_SIZE 15
+#define INDEX_TITLE_SIZE 32 /*longest title kept (including its nul)*/
+#define INDEX_RECORD_SIZE (6 + INDEX_TITLE_SIZE)
+#define INDEX_PATH_SIZE 32 /*longest path of an indexed file (including its nul)*/
+struct Tune{
+	uint32_t offset; /*offset of the "X:" line that starts the tune*/
+	uint16_t number; /*the number on that line*/
+} tune_index[TUNE_INDEX_SIZE];
+uint8_t tune_count = 0; /*number of tunes in tune_index*/
+char index_path[INDEX_PATH_SIZE]; /*the file tune_index belongs to*/
+uint8_t index_cached = 0; /*set if the titles are in the sidecar file*/
+
+/* checkpoints: the state of the reader at the start of every checkpoint_interval'th bar it reads, so that abc_seek_bar() only has to
+ * read from the last one before the bar it wants rather than from the start of the song. bars are counted as they're read, so the bars
+ * of a repeated section are counted again the second time through. checkpoints are only kept for abc songs with one voice
+ */
+struct Checkpoint{
+	uint32_t offset; /*offset of the first character of the bar*/
+	uint32_t tick; /*song position of the start of the bar*/
+	uint16_t bar; /*number of bar lines read before it*/
+	uint8_t key_signature[7];
+	uint16_t tempo; /*parse_tick_length (the ramp, if it applies, is worked out from tick)*/
+	uint16_t default_note_length;
+	uint8_t waves[CHANNELS]; /*wave of each channel once the notes before the bar have been played*/
+	uint32_t repeat_start;
+	uint8_t repeat_pass;
+	uint8_t repeat_key[7];
+} checkpoints[CHECKPOINTS];
+uint8_t checkpoint_count = 0; /*number of checkpoints kept; the first is always the start of the song*/
+uint16_t checkpoint_interval = CHECKPOINT_BARS; /*number of bars between checkpoints*/
+uint16_t bar_number = 0; /*number of bar lines read so far*/
+uint8_t parse_wave[CHANNELS]; /*wave of each channel as of parse_tick, i.e. once the notes read so far have been played*/
+uint8_t skipping = 0; /*set while abc_seek_bar() is reading through the bars before the one it wants, when nothing is queued*/
+uint16_t skip_to_bar = 0; /*the bar it wants*/
 
 /*  initialise the PWM 
  *	credit to: 
@@ -123,14 +408,21 @@ void pwm_init(void) {
     /* set initial duty cycle to zero */
     OCR1A = 0;
     OCR3A = 0;
+
+    /* render the first two blocks before ISR1 starts playing them */
+    play_block = 0;
+    play_index = 0;
+    sample_hold = PWM_OVERFLOWS_PER_SAMPLE;
+    block_full[0] = block_full[1] = 0;
+    last_sample = 0;
+    pwm_render();
     
-    /* Setup Timer1 (RCH, used for waveform generation) */
+    /* Setup Timer1 (RCH, used to output samples) */
     TCNT1 = 0;
     TIMSK1 |= _BV(TOIE1);
     
-    /* Setup Timer3 (LCH, used to manipulate the clock for sequencing) */
+    /* Setup Timer3 (LCH, only used for PWM output) */
     TCNT3 = 0;
-    TIMSK3 |= _BV(TOIE3);
 
     pwm_in_use = 1;
 
@@ -156,62 +448,267 @@ void pwm_stop(void){
 	}
 }
 
-/* generate a waveform from the active notes in the channels */
-/* NOTE: if notes start playing at a lower pitch than you were expecting, it likely means that ISR1 is taking too long to compute!*/
+/* output the next sample of the current block on both audio channels */
 ISR(TIMER1_OVF_vect)
 {	
-	if(pwm_in_use){
-		if(!tick_scaler){ /*only generate the waveform once every tick_scaler times the interrupt is raised*/
-			int8_t polyphony = 0; /*number of channels playing simultaneously on this tick*/
-			int16_t combined_ticks = 0; /*temp variable to accumulate */
-			uint8_t i;
-			for(i=0;i<CHANNELS;i++){
-				if(channels[i].note!=0xFF){
-					polyphony++;
-					/*advance tick according to pitch*/
-					channels[i].tick += note_step[channels[i].note];
-					channels[i].tick &= 511;
-					/*generate appropriate wave from current tick*/
-					if(channels[i].wave==SINE){
-						combined_ticks += sine[channels[i].tick >> 1];
-					}else if(channels[i].wave==SQUARE){
-						combined_ticks += (channels[i].tick & 256) ? 255 : 0;
-					}else if(channels[i].wave==TRIANGLE){
-						uint8_t x = (channels[i].tick & 255);
-						uint8_t y = channels[i].tick & 256 ? -x-1 : x;
-						combined_ticks += y;
-					}else{
-						combined_ticks += channels[i].tick >> 1;
-					}
+	if(--sample_hold) return;
+	sample_hold = PWM_OVERFLOWS_PER_SAMPLE;
+	if(!block_full[play_block]){ /*pwm_render() hasn't been called often enough; hold the last sample*/
+		underruns++;
+		return;
+	}
+	uint8_t sample = sample_blocks[play_block][play_index];
+	OCR1A = sample;
+	OCR3A = sample;
+	if(++play_index == SAMPLE_BLOCK_SIZE){
+		play_index = 0;
+		block_full[play_block] = 0;
+		play_block ^= 1;
+	}
+}
+
+/* fill whichever sample blocks ISR1 has finished playing; call this regularly while notes are playing (abc_poll() does this for you) */
+void pwm_render(void){
+	uint8_t b = play_block; /*if the block being played is empty there has been an underrun; fill that one first*/
+	if(!block_full[b]){
+		render_block(sample_blocks[b]);
+		block_full[b] = 1;
+	}
+	b ^= 1;
+	if(!block_full[b]){
+		render_block(sample_blocks[b]);
+		block_full[b] = 1;
+	}
+}
+
+/* generate a block of waveform from the active notes in the channels.
+ * the notes can't change part-way through a block, so each channel is rendered for the whole block in one go
+ * and the waveform only has to be chosen once per channel rather than once per sample
+ */
+void render_block(volatile uint8_t* block){
+	uint16_t mix[SAMPLE_BLOCK_SIZE]; /*sum of all channels for each sample*/
+	uint8_t polyphony = 0; /*number of channels playing simultaneously in this block*/
+	uint8_t i, n;
+	memset(mix, 0, sizeof(mix));
+	for(i=0;i<CHANNELS;i++){
+		if(channels[i].note==0xFF) continue;
+		polyphony++;
+		uint16_t phase = channels[i].phase;
+		uint16_t step = channels[i].step;
+		/*advance the phase according to pitch (letting it wrap round), and generate the appropriate wave from its top bits*/
+		switch(channels[i].wave){
+			case SINE:
+				for(n=0;n<SAMPLE_BLOCK_SIZE;n++){
+					phase += step;
+					mix[n] += pgm_read_byte(&sine[phase >> 8]);
 				}
-			}
-			/*if at least one note just played, update the duty cycle*/
-			if(polyphony){
-				combined_ticks /= polyphony;
-				OCR1A = combined_ticks;
-				OCR3A = OCR1A;
-			}
+				break;
+			case SQUARE:
+				for(n=0;n<SAMPLE_BLOCK_SIZE;n++){
+					phase += step;
+					mix[n] += (phase & 0x8000) ? 255 : 0;
+				}
+				break;
+			case TRIANGLE:
+				for(n=0;n<SAMPLE_BLOCK_SIZE;n++){
+					phase += step;
+					uint8_t x = phase >> 7;
+					mix[n] += (phase & 0x8000) ? (uint8_t)~x : x;
+				}
+				break;
+			default: /*SAWTOOTH*/
+				for(n=0;n<SAMPLE_BLOCK_SIZE;n++){
+					phase += step;
+					mix[n] += phase >> 8;
+				}
+		}
+		channels[i].phase = phase;
+	}
+	/*if no notes are playing, hold the duty cycle where it was*/
+	if(polyphony){
+#if MIXER == MIX_AVERAGE
+		mix_average(block, mix, polyphony);
+#elif MIXER == MIX_RECIPROCAL
+		mix_gain(block, mix, polyphony, pgm_read_word(&mix_reciprocal[polyphony]));
+#else
+		mix_gain(block, mix, polyphony, MIX_GAIN);
+#endif
+		last_sample = block[SAMPLE_BLOCK_SIZE-1];
+	}else{
+		for(n=0;n<SAMPLE_BLOCK_SIZE;n++){
+			block[n] = last_sample;
+		}
+	}
+}
+
+#if MIXER == MIX_AVERAGE || defined(JPML_BENCHMARK)
+/*mix the channels by averaging them. the volume of each note jumps whenever another starts or stops, and it costs a software divide per sample*/
+void mix_average(volatile uint8_t* block, uint16_t* mix, uint8_t polyphony){
+	uint8_t n;
+	for(n=0;n<SAMPLE_BLOCK_SIZE;n++){
+		block[n] = mix[n] / polyphony;
+	}
+}
+#endif
+
+/* mix the channels by scaling the sum of the channels (centred on 128) by gain/256.
+ * with MIX_GAIN each note has the same volume however many others are playing; with mix_reciprocal[polyphony] it's an average.
+ * |sum - 128*polyphony| * gain never exceeds 128*256, so it fits in 16 bits and the multiply is a couple of hardware MULs
+ */
+void mix_gain(volatile uint8_t* block, uint16_t* mix, uint8_t polyphony, int16_t gain){
+	int16_t centre = 128 * polyphony;
+	uint8_t n;
+	for(n=0;n<SAMPLE_BLOCK_SIZE;n++){
+		block[n] = 128 + (((int16_t)(mix[n] - centre) * gain) >> 8);
+	}
+}
+
+/*get the number of samples that couldn't be output because pwm_render() wasn't called often enough*/
+uint16_t pwm_underruns(void){
+	uint16_t u;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		u = underruns;
+	}
+	return u;
+}
+
+#ifdef JPML_BENCHMARK
+/* measure how many cpu cycles it takes to render one sample with the given number of channels all playing the given wave.
+ * the cost of each voice is (pwm_benchmark(n, wave) - pwm_benchmark(0, wave)) / n; each sample has to be rendered in well under
+ * PWM_PERIOD * PWM_OVERFLOWS_PER_SAMPLE cycles to leave time for everything else.
+ * returns 0 if the pwm is in use, because timer 1 is borrowed as a cycle counter
+ */
+uint16_t pwm_benchmark(uint8_t sounding, uint8_t wave){
+	struct Channel saved[CHANNELS];
+	uint16_t cycles;
+	uint8_t i;
+	if(pwm_in_use) return 0;
+	if(sounding > CHANNELS) sounding = CHANNELS;
+	memcpy(saved, channels, sizeof(channels));
+	for(i=0;i<CHANNELS;i++){
+		channels[i].note = i < sounding ? A4 + 4*i : 0xFF; /*a spread of notes, so every channel has a different step*/
+		channels[i].step = pgm_read_word(&note_step[A4 + 4*i]);
+		channels[i].wave = wave;
+		channels[i].phase = 0;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		TCCR1A = 0;
+		TCCR1B = _BV(CS10); /*normal mode, clk/1: TCNT1 counts cpu cycles*/
+		TCNT1 = 0;
+		render_block(sample_blocks[0]);
+		cycles = TCNT1;
+		TCCR1B = 0;
+	}
+	memcpy(channels, saved, sizeof(channels));
+	return cycles / SAMPLE_BLOCK_SIZE;
+}
+
+/* measure how many cpu cycles the given mixer (MIX_AVERAGE, MIX_FIXED_GAIN or MIX_RECIPROCAL) takes per sample to mix the given number of sounding channels,
+ * so that the division-free mixers can be compared with averaging. returns 0 if the pwm is in use (timer 1 is borrowed as a cycle counter)
+ */
+uint16_t pwm_benchmark_mixer(uint8_t sounding, uint8_t mixer){
+	uint16_t mix[SAMPLE_BLOCK_SIZE];
+	uint16_t cycles;
+	uint8_t n;
+	if(pwm_in_use) return 0;
+	if(sounding < 1) sounding = 1;
+	if(sounding > CHANNELS) sounding = CHANNELS;
+	for(n=0;n<SAMPLE_BLOCK_SIZE;n++){
+		mix[n] = sounding * (uint16_t)(n * (256 / SAMPLE_BLOCK_SIZE)); /*a ramp, so the divide doesn't get any easy values*/
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		TCCR1A = 0;
+		TCCR1B = _BV(CS10); /*normal mode, clk/1: TCNT1 counts cpu cycles*/
+		TCNT1 = 0;
+		if(mixer==MIX_AVERAGE){
+			mix_average(sample_blocks[0], mix, sounding);
+		}else if(mixer==MIX_RECIPROCAL){
+			mix_gain(sample_blocks[0], mix, sounding, pgm_read_word(&mix_reciprocal[sounding]));
+		}else{
+			mix_gain(sample_blocks[0], mix, sounding, MIX_GAIN);
 		}
-		tick_scaler++;
-		tick_scaler&=7;
-		/*
-		 * from experimentation, one real tick every 8 has the best results; hence 7 as a magic number.
-		 * decreasing 7 results in a higher quality waveform, but the ISR has a shorter deadline and can't cope with 3 voices anymore
-		 * increasing 7 makes the ISR take less time but considerably distorts the waveform
-		 */
+		cycles = TCNT1;
+		TCCR1B = 0;
 	}
+	return cycles / SAMPLE_BLOCK_SIZE;
+}
+#endif
+
+/*play a note on the lowest free channel available, or replace a note chosen by the steal policy if they're all taken*/
+void channel_play(uint8_t note, uint16_t duration){
+	play_on(note, duration, 0);
+}
 
+/*play a note on the given channel if it's free, otherwise as channel_play() does. each voice of a song prefers its own channel*/
+void play_on(uint8_t note, uint16_t duration, uint8_t channel){
+	uint8_t free_channels = ~occupied_channels & ALL_CHANNELS;
+	uint8_t free_channel;
+	if(!(occupied_channels & (1 << channel))){
+		free_channel = channel;
+	}else if(free_channels){
+		free_channels &= (uint8_t)-free_channels; /*isolate the lowest free channel's bit*/
+		free_channel = bit_index(free_channels);
+	}else{
+		free_channel = steal_channel();
+		if(free_channel==0xFF){
+			notes_dropped++;
+			return;
+		}
+		notes_stolen++;
+	}
+	channels[free_channel].note=note;
+	channels[free_channel].step=note < NOTES ? pgm_read_word(&note_step[note]) : 0; /*rests (and notes off the end of the keyboard) don't move*/
+	channels[free_channel].time_until_release=duration;
+	channels[free_channel].phase=0;
+	channels[free_channel].started=note_serial++;
+	occupied_channels |= (1 << free_channel);
 }
 
-/*play a note on the lowest free channel available, or replace the note in channel 3 if they're all taken*/
-void channel_play(uint8_t note, uint8_t duration){
-	if(~occupied_channels){
-		int8_t free_channel = (occupied_channels & 1) * (1 + (occupied_channels & 3)/3); /*calculates (MSB+1) if <3 channels occupied; else MSB if all occupied*/
-		channels[free_channel].note=note;
-		channels[free_channel].time_until_release=duration;
-		channels[free_channel].tick=0;
-		occupied_channels |= (1 << free_channel);
+/* choose which channel to take over when they're all playing, according to steal_policy; or 0xFF if the new note should be dropped.
+ * this is only reached when every channel is busy, and looks at each channel once (at most 8 of them)
+ */
+uint8_t steal_channel(void){
+	uint8_t i, victim = 0xFF, lowest = 0xFF;
+	uint16_t key, best = 0;
+	if(steal_policy==STEAL_NONE) return 0xFF;
+	if(steal_policy==STEAL_PROTECT_LOWEST){
+		/*find the lowest note so it can be left alone (rests are 0xFF, so they never count as the lowest)*/
+		uint8_t lowest_note = 0xFF;
+		for(i=0;i<CHANNELS;i++){
+			if(channels[i].note < lowest_note){
+				lowest_note = channels[i].note;
+				lowest = i;
+			}
+		}
+	}
+	for(i=0;i<CHANNELS;i++){
+		if(i==lowest) continue;
+		if(steal_policy==STEAL_SHORTEST){
+			key = ~channels[i].time_until_release; /*least time left = highest key*/
+		}else{
+			key = note_serial - channels[i].started; /*age in notes, even once note_serial has wrapped round; oldest = highest key*/
+		}
+		if(victim==0xFF || key > best){
+			best = key;
+			victim = i;
+		}
 	}
+	return victim;
+}
+
+/*choose which note channel_play() replaces when all channels are playing (STEAL_NONE, STEAL_OLDEST, STEAL_SHORTEST or STEAL_PROTECT_LOWEST)*/
+void channel_set_steal_policy(uint8_t policy){
+	steal_policy = policy;
+}
+
+/*get the number of notes that have been cut short to make room for new ones*/
+uint16_t channel_stolen_count(void){
+	return notes_stolen;
+}
+
+/*get the number of notes that weren't played because there was no room for them*/
+uint16_t channel_dropped_count(void){
+	return notes_dropped;
 }
 
 /*stop the note on the given channel*/
@@ -230,113 +727,705 @@ void channel_set_wave(uint8_t channel, uint8_t wave){
 	channels[channel].wave=wave;
 }
 
-/* left audio channel timer is also used to increment the sequencer clock */
-ISR(TIMER3_OVF_vect)
+/*value of OCR0A for the next span when there are c counts left until the next tick.
+  the last 512 counts are split in half so there's never a tiny span at the end of a tick, which keeps OCR0A well ahead of TCNT0*/
+#define next_span(c) ((c) > 511 ? 255 : (c) > 256 ? ((c) >> 1) - 1 : (c) - 1)
+
+/*  initialise the sequencer clock
+ *	timer 0 counts at clk/256 (31.25kHz at 8MHz), the same rate timer 3 used to overflow at, so tempos keep their old meaning.
+ *	the compare match only fires at the end of each tick, except that an 8-bit timer can't count to more than 256,
+ *	so longer ticks are split up into a few spans of at most 256 counts
+ */
+void sequencer_init(void){
+	tick_due = 0;
+	song_clock = 0;
+	tick_time = bpmLimit;
+	lateness_total = 0;
+	lateness_max = 0;
+	TCCR0A = _BV(WGM01); /*CTC mode, TOP = OCR0A*/
+	TCCR0B = 0;
+	TCNT0 = 0;
+	OCR0A = next_span(bpmLimit);
+	TIFR0 = _BV(OCF0A);
+	TIMSK0 |= _BV(OCIE0A);
+	TCCR0B = _BV(CS02); /*prescaler: clk/256*/
+}
+
+/*stop the sequencer clock*/
+void sequencer_stop(void){
+	TCCR0B = 0;
+	TIMSK0 &= ~_BV(OCIE0A);
+}
+
+/* sequencer clock: add the span that just finished to the song clock, and aim the next span at the next tick */
+ISR(TIMER0_COMPA_vect)
 {
-	bpmCounter++;
+	song_clock += (uint16_t)OCR0A + 1;
+	int32_t remaining = tick_time - song_clock;
+	if(remaining <= 0){
+		tick_due = 1;
+		/*abc_poll() hasn't moved tick_time on yet, so assume the tick after will be bpmLimit later*/
+		remaining += bpmLimit;
+		if(remaining <= 0) remaining = 256; /*abc_poll() is more than a tick behind; it'll catch up*/
+	}
+	OCR0A = next_span(remaining);
 } 
 
+/* get the exact number of timer 0 counts since the song started */
+uint32_t song_time(void){
+	uint32_t t;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+		uint8_t count = TCNT0;
+		t = song_clock;
+		if(TIFR0 & _BV(OCF0A)){ /*a span has just finished but ISR0 hasn't had a chance to add it yet*/
+			count = TCNT0;
+			t += (uint16_t)OCR0A + 1;
+		}
+		t += count;
+	}
+	return t;
+}
+
 /* set the tempo according to the given BPM */
 void set_tempo(uint16_t bpm){
-	bpmLimit = calculate_tempo_32nd(bpm);
+	set_tempo_beat(bpm, TICKS_PER_WHOLE / 4);
 }
 
-/* figure out to what number the timer 3 interrupt should count to before advancing by 1/32nd of a bar,
- * given bpm in the form of number of crotchets (1/4-notes) per bar
+/* set the tempo to bpm beats per minute, where each beat is beat_length ticks long (e.g. "Q:3/8=60" is 60 beats of 3/8 of TICKS_PER_WHOLE) */
+void set_tempo_beat(uint16_t bpm, uint16_t beat_length){
+	ramp_ticks = 0;
+	stop_ramp(song_tick + tick_base);
+	parse_tick_length = calculate_tick_length(bpm, beat_length);
+	set_tick_length(parse_tick_length);
+}
+
+/*set the number of timer 0 counts in a tick, starting from the next tick*/
+void set_tick_length(uint16_t limit){
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){ /*ISR0 reads bpmLimit*/
+		bpmLimit = limit;
+	}
+}
+
+/* figure out how many timer 0 counts there should be in a tick, given bpm beats of beat_length ticks per minute.
+ * timer 0 counts at F_CPU/256, so for crotchets this works out as 39062.5/bpm at 8MHz (rounded to the nearest count)
  */
-uint32_t calculate_tempo_32nd(uint16_t bpm){
-	return 153750/bpm;
+uint16_t calculate_tick_length(uint16_t bpm, uint16_t beat_length){
+	uint32_t limit;
+	if(!bpm || !beat_length) return 0xFFFF; /*as slow as possible rather than dividing by zero*/
+	limit = TICK_LENGTH(bpm, beat_length);
+	if(limit > 0xFFFF) return 0xFFFF;
+	return limit ? limit : 1;
+}
+
+/* change the tempo gradually to bpm crotchets per minute, over the given number of ticks: the length of a tick changes by the
+ * same amount every tick, so the divides are all done here rather than every tick. a "Q:" change or set_tempo() stops the ramp where it is
+ */
+void abc_tempo_ramp(uint16_t bpm, uint16_t ticks){
+	uint8_t i;
+	if(!ticks){
+		set_tempo(bpm);
+		return;
+	}
+	ramp_target = calculate_tick_length(bpm, TICKS_PER_WHOLE / 4);
+	ramp_length = (uint32_t)bpmLimit << 8;
+	ramp_step = ((int32_t)ramp_target - bpmLimit) * 256 / ticks; /*(shifting a negative number left is undefined)*/
+	ramp_ticks = ticks;
+	ramp_start_tick = song_tick + tick_base;
+	ramp_start_length = ramp_length;
+	ramp_total = ticks;
+	ramp_stop_tick = 0xFFFFFFFF;
+	for(i=0;i<queue_length;i++){ /*a "Q:" change may have been read ahead already*/
+		struct Event* event = &event_queue[(queue_head + i) & (EVENT_QUEUE_SIZE - 1)];
+		if(event->type==BIN_TEMPO){
+			ramp_stop_tick = event->tick + tick_base;
+			break;
+		}
+	}
+}
+
+/*the ramp doesn't apply from the given song position on (if it did up to there)*/
+void stop_ramp(uint32_t position){
+	if(position >= ramp_start_tick && position < ramp_stop_tick) ramp_stop_tick = position;
+}
+
+/*get the length of the tick at the given song position, as far as the song has been read: parse_tick_length, unless the ramp applies there*/
+uint16_t position_tick_length(uint32_t position){
+	uint32_t done = position - ramp_start_tick;
+	if(position < ramp_start_tick || position >= ramp_stop_tick) return parse_tick_length;
+	if(done >= ramp_total) return ramp_target;
+	return (ramp_start_length + ramp_step * (int32_t)done) >> 8;
+}
+
+/* work out the length of a tick in timer 0 counts from the rest of a "Q:" line: "1/4=120" is 120 crotchets per minute,
+ * and a number on its own is crotchets per minute too
+ */
+uint16_t parse_tempo(char* tempostring){
+	uint8_t i;
+	/*read the note length into a string*/
+	char note_length_string[16];
+	for(i=0;i<15;i++){
+		if(tempostring[i]=='=' || tempostring[i]=='\0'){
+			break;
+		}else{
+			note_length_string[i]=tempostring[i];
+		}
+	}
+	note_length_string[i]='\0';
+	/*calculate the note length from the string*/
+	uint16_t note_length;
+	if(tempostring[i]=='='){
+		note_length = string_to_note_length(note_length_string, TICKS_PER_WHOLE);
+		i++;
+	}else{
+		/*if there's no = sign in the string, then no note length was specified, so default to 1/4*/
+		note_length = TICKS_PER_WHOLE / 4;
+		i=0;
+	}
+	/*read the tempo from the rest of the string, as that many beats of note_length per minute*/
+	return calculate_tick_length(atoi(tempostring+i), note_length);
 }
 
 /*mount and read the header of a given abc file, ready to be played*/
 FRESULT abc_load_file(char* filename){
+	return load_song(filename, 0);
+}
+
+/* load the song in the given file, starting at the given offset: 0 for the start of the file (which may be a compiled song),
+ * or the "X:" line of a tune in an abc file. the song finishes at the next "X:" line
+ */
+FRESULT load_song(char* filename, uint32_t offset){
 	/*initialise all channels*/
 	uint8_t i;
     for(i=0;i<CHANNELS;i++){
     	channels[i].note=0xFF;
     	channels[i].wave=SINE;
     	channels[i].time_until_release=0;
-    	channels[i].tick=0;
+    	channels[i].phase=0;
     }
 	time_until_next_note=0;
+	broken_rhythm_next=0;
+	tuplet_notes=0;
+	repeat_pass=0;
+	repeat_seeks=0;
+	seek_time=0;
+	queue_head=0;
+	queue_length=0;
+	queue_high_water=0;
+	parse_tick=0;
+	reading_file=0;
+	voice_count=0;
+	reader=voices;
+	reading_voice=0;
+	event_voice=0;
+	tune_end=0xFFFFFFFF;
+	checkpoint_count=0;
+	checkpoint_interval=CHECKPOINT_BARS;
+	ramp_ticks=0;
+	ramp_start_tick=0;
+	ramp_stop_tick=0;
+	tick_base=0;
+	parse_tick_length=bpmLimit; /*songs without a "Q:" line carry on at the current tempo*/
+	bar_number=0;
+	default_note_length=TICKS_PER_WHOLE/4; /*nothing else is kept from the last song loaded*/
+	for(i=0;i<7;i++) key_signature[i]=pgm_read_byte(&C_MAJOR[i]);
+	if(title) free(title);
+	title=0;
+	for(i=0;i<CHANNELS;i++) parse_wave[i]=SINE;
+	uint8_t body_voice = 0xFF; /*voice named by the last "V:" line of the header, which the first music of the body belongs to*/
     /*mount and open the file*/
 	f_mount(&fs, "", 0);
-	FRESULT result = f_open(&file, filename, FA_READ);
+	FRESULT result = f_open(&reader->file, filename, FA_READ);
 	/*if the file exists and can be read, read the entire header*/
 	if(result == FR_OK){
-		if(readlinebuffer) free(readlinebuffer);
-		readlinebuffer=malloc(sizeof(char)*LINE_BUFFER_SIZE);
-		/*read lines of the file*/
-		while(readlinebuffer=f_gets(readlinebuffer, LINE_BUFFER_SIZE, &file)){
+		use_link_map(&reader->file);
+		reading_file = 1;
+		reader->reading = 1;
+		song_format = FORMAT_ABC;
+		if(offset){ /*a tune in the middle of an abc file*/
+			result = f_lseek(&reader->file, offset);
+			reader->chunk_length = 0;
+			reader->chunk_index = 0;
+			if(result != FR_OK){
+				reading_file = 0;
+				return result;
+			}
+		}else switch(bin_load_header()){
+			case(HEADER_COMPILED):
+				return result;
+			case(HEADER_UNSUPPORTED): /*compiled by a different abc2bin; recompile it for this player*/
+				reading_file = 0;
+				return FR_INVALID_OBJECT;
+			default:; /*an ordinary abc file*/
+		}
+		/*read the header a line at a time*/
+		current_char = file_getc();
+		while(current_char>=0){
 			/*if the current line is a valid header line*/
-			if(readlinebuffer[1]==':' || readlinebuffer[0]=='%' || readlinebuffer[1]=='%'){
-				switch(readlinebuffer[0]){
+			if(at_field_line() || current_char=='%' || (current_char!='\n' && file_peek()=='%')){
+				read_field();
+				switch(field[0]){
 					case('T'):	/*title*/
 						if(title) free(title);
-						title = malloc(sizeof(char)*strlen(readlinebuffer+2));
-						strcpy(title, readlinebuffer+2);
+						title = malloc(sizeof(char)*(strlen(field+2)+1));
+						strcpy(title, field+2);
 						break;
 					case('L'): /*unit note length*/
-						default_note_length = string_to_note_length(readlinebuffer+2);
+						default_note_length = string_to_note_length(field+2, TICKS_PER_WHOLE);
 						break;
 					case('Q'): /*tempo*/
-						i=0;
-						/*read the note length into a string*/
-						char note_length_string[16];
-						for(i=0;i<15;i++){
-							if(readlinebuffer[i+2]=='=' || readlinebuffer[i+2]=='\0'){
-								break;
-							}else{
-								note_length_string[i]=readlinebuffer[i+2];
-							}
-						}
-						note_length_string[i]='\0';
-						/*calculate the note length from the string*/
-						uint16_t note_length;
-						if(readlinebuffer[i+2]=='='){
-							note_length = string_to_note_length(note_length_string);
-							i++;	
-						}else{
-							/*if there's no = sign in the string, then no note length was specified, so default to 1/4*/
-							note_length = 8;
-							i=0;
-						}
-						/*read the tempo from the rest of the string*/
-						uint16_t tempo = atoi(readlinebuffer+i+2);
-						/*adjust tempo to be its equivalent for Q:1/4=tempo*/
-						if(note_length<8){
-							while(note_length<8){
-								note_length <<= 1;
-								tempo >>= 1;
-							}
-						}else if(note_length>8){
-							while(note_length>8){
-								note_length >>= 1;
-								tempo <<= 1;
-							}
-						}
-						/*finally set the tempo*/
-						bpmLimit = calculate_tempo_32nd(tempo);
+						ramp_ticks = 0;
+						parse_tick_length = parse_tempo(field+2);
+						set_tick_length(parse_tick_length);
 						break;
 					case('K'): /*key signature*/
-						changeKey(readlinebuffer+2);
+						changeKey(field+2);
 						break;
 					case('I'): /*'instruction' (used to change a channel's waveform)*/
-						parse_lf_tag(readlinebuffer+2);
+						parse_lf_tag(field+2);
+						break;
+					case('V'): /*voice*/
+						body_voice = find_voice(field+2);
+						if(body_voice==0xFF) body_voice = add_voice(field+2);
 						break;
 					default:; /*ignore: either unknown, not supported, or nothing to do for it*/
 				}
-			}else{ /*finished reading the header*/
+				current_char = file_getc(); /*on to the start of the next line*/
+			}else{ /*finished reading the header; current_char is the first character of the body*/
+				start_section(); /*a ":|" without a "|:" before it repeats from here*/
+				break;
+			}
+		}
+		/*a tune with voices needs a reader for each of them*/
+		if(voice_count){
+			find_voices(body_voice);
+			start_voices(filename);
+		}
+		if(reading_file) record_checkpoint(); /*the start of the song is bar 0*/
+	}
+	return result;
+}
+
+/*get the index of the voice named at the start of voicestring (the rest of a "V:" line), or 0xFF if there isn't one*/
+uint8_t find_voice(char* voicestring){
+	uint8_t v, i;
+	while(*voicestring==' ') voicestring++;
+	for(v=0;v<voice_count;v++){
+		for(i=0;i<VOICE_NAME_SIZE-1 && voices[v].name[i] && voices[v].name[i]==voicestring[i];i++);
+		if(!voices[v].name[i] && (i==VOICE_NAME_SIZE-1 || voicestring[i]=='\0' || voicestring[i]==' ')) return v;
+	}
+	return 0xFF;
+}
+
+/*add the voice named at the start of voicestring; returns its index, or 0xFF if there are already VOICES of them*/
+uint8_t add_voice(char* voicestring){
+	uint8_t i;
+	if(voice_count==VOICES) return 0xFF;
+	while(*voicestring==' ') voicestring++;
+	for(i=0;i<VOICE_NAME_SIZE-1 && voicestring[i] && voicestring[i]!=' ';i++) voices[voice_count].name[i] = voicestring[i];
+	voices[voice_count].name[i] = '\0';
+	voices[voice_count].reading = 0;
+	return voice_count++;
+}
+
+/* read through the body once to find where each voice's music starts (just after the first "V:" line for it), keeping it in the voice's
+ * repeat_start. the music at the start of the body belongs to body_voice. this is the only time the whole file is read at once,
+ * and it's only done for tunes that have voices
+ */
+void find_voices(uint8_t body_voice){
+	uint8_t v;
+	reader->reading = 0; /*voices[0] was only reading the header*/
+	if(body_voice!=0xFF){ /*(the music of a voice there wasn't room for is left out)*/
+		voices[body_voice].repeat_start = repeat_start;
+		voices[body_voice].reading = 1;
+	}
+	while(current_char>=0){
+		if(current_char=='X' && at_field_line()){ /*the next tune*/
+			tune_end = char_offset();
+			break;
+		}else if(current_char=='V' && at_field_line()){
+			read_field();
+			v = find_voice(field+2);
+			if(v==0xFF) v = add_voice(field+2);
+			if(v!=0xFF && !voices[v].reading){
+				voices[v].repeat_start = char_offset() + 1; /*the start of the next line*/
+				voices[v].reading = 1;
+			}
+		}else{
+			skip_line();
+		}
+		if(current_char>=0) current_char = file_getc();
+	}
+}
+
+/* give every voice found by find_voices() its own cursor at the start of its music, and its own copy of the parser state.
+ * a voice that can't be opened is left out
+ */
+void start_voices(char* filename){
+	uint8_t v, key[7];
+	memcpy(key, key_signature, sizeof(key)); /*every voice starts in the key from the header*/
+	for(v=0;v<voice_count;v++){
+		struct Voice* voice = &voices[v];
+		if(!voice->reading) continue;
+		if(v && f_open(&voice->file, filename, FA_READ)!=FR_OK){
+			voice->reading = 0;
+			continue;
+		}
+		use_link_map(&voice->file);
+		f_lseek(&voice->file, voice->repeat_start);
+		voice->chunk_length = 0;
+		voice->chunk_index = 0;
+		voice->current_char = '\0'; /*starting a line deals with any K: or I: lines at the start of the voice's music*/
+		voice->parse_tick = 0;
+		voice->broken_rhythm_next = 0;
+		voice->tuplet_notes = 0;
+		voice->repeat_pass = 0;
+		memcpy(voice->key_signature, key, sizeof(key));
+	}
+	/*switch_voice() only loads a voice's state if it isn't the current one, so load the first voice by hand*/
+	for(v=0;v<voice_count && !voices[v].reading;v++);
+	if(v==voice_count){ /*no music at all*/
+		reading_file = 0;
+		return;
+	}
+	reader = &voices[v];
+	reading_voice = v;
+	event_voice = v;
+	current_char = reader->current_char;
+	parse_tick = 0;
+	broken_rhythm_next = 0;
+	tuplet_notes = 0;
+	repeat_pass = 0;
+	start_line();
+	start_section();
+	/*get the others to the first note of their music in the same way*/
+	for(v++;v<voice_count;v++){
+		if(!voices[v].reading) continue;
+		switch_voice(v);
+		start_line();
+		start_section();
+	}
+}
+
+/*make voice v the one being read: put the parser state of the current voice away, and get v's out*/
+void switch_voice(uint8_t v){
+	struct Voice* voice = reader;
+	if(v==reading_voice) return;
+	voice->current_char = current_char;
+	voice->parse_tick = parse_tick;
+	voice->broken_rhythm_next = broken_rhythm_next;
+	voice->tuplet_notes = tuplet_notes;
+	voice->tuplet_p = tuplet_p;
+	voice->tuplet_q = tuplet_q;
+	voice->tuplet_remainder = tuplet_remainder;
+	voice->repeat_start = repeat_start;
+	voice->repeat_pass = repeat_pass;
+	memcpy(voice->repeat_key, repeat_key, sizeof(repeat_key));
+	memcpy(voice->key_signature, key_signature, sizeof(key_signature));
+	voice = reader = &voices[v];
+	reading_voice = v;
+	event_voice = v;
+	current_char = voice->current_char;
+	parse_tick = voice->parse_tick;
+	broken_rhythm_next = voice->broken_rhythm_next;
+	tuplet_notes = voice->tuplet_notes;
+	tuplet_p = voice->tuplet_p;
+	tuplet_q = voice->tuplet_q;
+	tuplet_remainder = voice->tuplet_remainder;
+	repeat_start = voice->repeat_start;
+	repeat_pass = voice->repeat_pass;
+	memcpy(repeat_key, voice->repeat_key, sizeof(repeat_key));
+	memcpy(key_signature, voice->key_signature, sizeof(key_signature));
+}
+
+/*get the voice still reading whose next note is due first (the lowest numbered one if there's a tie)*/
+uint8_t earliest_voice(void){
+	uint8_t v, earliest = reading_voice;
+	uint32_t tick, earliest_tick = reader->reading ? parse_tick : 0xFFFFFFFF;
+	for(v=0;v<voice_count;v++){
+		if(!voices[v].reading) continue;
+		tick = v==reading_voice ? parse_tick : voices[v].parse_tick;
+		if(tick < earliest_tick || (tick==earliest_tick && v < earliest)){
+			earliest = v;
+			earliest_tick = tick;
+		}
+	}
+	return earliest;
+}
+
+/*skip the music of other voices, up to the next "V:" line for the voice being read (or the end of the file)*/
+void skip_voice(void){
+	uint32_t offset;
+	while(current_char>=0){
+		skip_line();
+		if(current_char<0) return;
+		current_char = file_getc();
+		if((current_char=='V' || current_char=='X') && at_field_line()){
+			offset = char_offset();
+			read_field();
+			if(field[0]=='X'){
+				end_tune(offset);
+				return;
+			}
+			if(find_voice(field+2)==reading_voice) return;
+		}
+	}
+}
+
+/*stop reading at the "X:" line at the given offset, where the next tune starts, leaving current_char at the end of the file for every voice*/
+void end_tune(uint32_t offset){
+	tune_end = offset;
+	reader->chunk_index = reader->chunk_length; /*the rest of the chunk is past the end*/
+	current_char = -1;
+}
+
+/*the voice being read has reached the end of the tune. once every voice has, the song finishes when everything before this has been played*/
+void end_voice(void){
+	uint8_t v;
+	reader->reading = 0;
+	for(v=0;v<voice_count;v++){
+		if(voices[v].reading) return;
+	}
+	queue_event(BIN_END, 0);
+	reading_file = 0;
+}
+
+/* find every "X:" tune in the given abc file, so that any of them can be loaded by abc_load_tune(). if the sidecar file from an
+ * earlier call is still up to date, the tunes are read from that instead of the abc file; otherwise it's (re)written
+ */
+FRESULT abc_index_file(char* filename){
+	FILINFO info;
+	FRESULT result;
+	struct ReaderState saved;
+	char sidecar_name[INDEX_PATH_SIZE];
+	tune_count = 0;
+	index_cached = 0;
+	if(strlen(filename) >= INDEX_PATH_SIZE-4) return FR_INVALID_NAME; /*(leaving room for the sidecar's extension)*/
+	strcpy(index_path, filename);
+	if(!fs.fs_type) f_mount(&fs, "", 0); /*(mounting it again would close the file of a song that's been loaded)*/
+	result = f_stat(filename, &info);
+	if(result != FR_OK) return result;
+	index_sidecar_name(sidecar_name);
+	if(index_read_sidecar(sidecar_name, &info)) return FR_OK;
+	borrow_reader(&saved);
+	result = f_open(&reader->file, filename, FA_READ);
+	if(result == FR_OK){
+		use_link_map(&reader->file); /*made now, so loading a tune from the file doesn't have to*/
+		index_scan(sidecar_name, &info);
+	}
+	return_reader(&saved);
+	return result;
+}
+
+/* get voices[0] ready to read the abc file from the start of a chunk, keeping the state of the song loaded (if any) in saved.
+ * it must be given back by return_reader() before the song is read again
+ */
+void borrow_reader(struct ReaderState* saved){
+	saved->voice = voices[0];
+	saved->reader = reader;
+	saved->current_char = current_char;
+	saved->tune_end = tune_end;
+	saved->voice_count = voice_count;
+	reader = voices;
+	voice_count = 0; /*(read in place in the sector buffer)*/
+	reader->chunk_length = 0;
+	reader->chunk_index = 0;
+	tune_end = 0xFFFFFFFF;
+}
+
+/* put back the state of the song loaded before borrow_reader(). the link map is made again for the song's file, in case the
+ * abc file that was read is a different one
+ */
+void return_reader(struct ReaderState* saved){
+	f_close(&voices[0].file);
+	voices[0] = saved->voice;
+	reader = saved->reader;
+	current_char = saved->current_char;
+	tune_end = saved->tune_end;
+	voice_count = saved->voice_count;
+	window_reader = 0; /*the sector buffer has the abc file in it now*/
+	if(voices[0].file.fs) use_link_map(&voices[0].file);
+}
+
+/*get the name of the sidecar file of index_path: the same name with the extension .JPI*/
+void index_sidecar_name(char* sidecar_name){
+	char* extension;
+	strcpy(sidecar_name, index_path);
+	extension = strrchr(sidecar_name, '.');
+	if(!extension || strchr(extension, '/')) extension = sidecar_name + strlen(sidecar_name); /*no extension to replace*/
+	strcpy(extension, ".JPI");
+}
+
+/*read the tunes from the sidecar file, if it's there and up to date; returns 0 if the abc file has to be read instead*/
+uint8_t index_read_sidecar(char* sidecar_name, FILINFO* info){
+	FIL sidecar;
+	UINT read;
+	uint8_t header[INDEX_HEADER_SIZE], record[INDEX_RECORD_SIZE];
+	uint8_t i, valid;
+	if(f_open(&sidecar, sidecar_name, FA_READ) != FR_OK) return 0;
+	valid = f_read(&sidecar, header, INDEX_HEADER_SIZE, &read) == FR_OK && read == INDEX_HEADER_SIZE
+		&& !memcmp(header, INDEX_MAGIC, INDEX_MAGIC_SIZE) && header[4] == INDEX_VERSION && header[5] == TUNE_INDEX_SIZE
+		&& header[14] <= TUNE_INDEX_SIZE /*(a damaged sidecar mustn't overrun tune_index)*/
+		&& get_long(header+6) == info->fsize && get_long(header+10) == ((uint32_t)info->fdate << 16 | info->ftime); /*the abc file hasn't changed*/
+	for(i=0;valid && i<header[14];i++){
+		valid = f_read(&sidecar, record, INDEX_RECORD_SIZE, &read) == FR_OK && read == INDEX_RECORD_SIZE;
+		if(!valid) break;
+		tune_index[i].offset = get_long(record);
+		tune_index[i].number = record[4] | record[5] << 8;
+	}
+	f_close(&sidecar);
+	if(!valid) return 0;
+	tune_count = i;
+	index_cached = 1;
+	return 1;
+}
+
+/* read through the abc file open in reader (borrowed by abc_index_file()) to find the "X:" line of each tune, and write them to the sidecar file. the index still
+ * works without the sidecar file (e.g. if the card is write-protected), but the next abc_index_file() has to read the whole file again
+ */
+void index_scan(char* sidecar_name, FILINFO* info){
+	FIL sidecar;
+	UINT written;
+	uint8_t header[INDEX_HEADER_SIZE], record[INDEX_RECORD_SIZE];
+	uint8_t in_tune = 0; /*set while record is the tune being read*/
+	uint32_t offset;
+	uint8_t opened = f_open(&sidecar, sidecar_name, FA_CREATE_ALWAYS | FA_WRITE) == FR_OK;
+	uint8_t writing = opened; /*cleared if anything can't be written, leaving the header invalid*/
+	memset(header, 0, INDEX_HEADER_SIZE); /*an invalid header until every record has been written*/
+	if(writing) writing = f_write(&sidecar, header, INDEX_HEADER_SIZE, &written) == FR_OK && written == INDEX_HEADER_SIZE;
+	current_char = file_getc();
+	while(current_char>=0){
+		if(at_field_line()){
+			offset = char_offset();
+			read_field();
+			if(field[0]=='X'){
+				if(in_tune && writing) writing = f_write(&sidecar, record, INDEX_RECORD_SIZE, &written) == FR_OK && written == INDEX_RECORD_SIZE;
+				window_reader = 0; /*(the sidecar is written through the sector buffer too)*/
+				in_tune = tune_count < TUNE_INDEX_SIZE; /*any more tunes are left out*/
+				if(in_tune){
+					tune_index[tune_count].offset = offset;
+					tune_index[tune_count].number = atoi(field+2);
+					memset(record, 0, INDEX_RECORD_SIZE);
+					put_long(record, offset);
+					record[4] = tune_index[tune_count].number;
+					record[5] = tune_index[tune_count].number >> 8;
+					tune_count++;
+				}
+			}else if(field[0]=='T' && in_tune && !record[6]){ /*only the first title of each tune*/
+				memcpy(record+6, field+2, strnlen(field+2, INDEX_TITLE_SIZE-1)); /*the rest of the record is already 0*/
+			}
+		}else{
+			skip_line();
+		}
+		if(current_char>=0) current_char = file_getc();
+	}
+	if(in_tune && writing) writing = f_write(&sidecar, record, INDEX_RECORD_SIZE, &written) == FR_OK && written == INDEX_RECORD_SIZE;
+	if(writing){ /*every record is there, so the header can be filled in*/
+		memcpy(header, INDEX_MAGIC, INDEX_MAGIC_SIZE);
+		header[4] = INDEX_VERSION;
+		header[5] = TUNE_INDEX_SIZE;
+		put_long(header+6, info->fsize);
+		put_long(header+10, (uint32_t)info->fdate << 16 | info->ftime);
+		header[14] = tune_count;
+		writing = f_lseek(&sidecar, 0) == FR_OK && f_write(&sidecar, header, INDEX_HEADER_SIZE, &written) == FR_OK && written == INDEX_HEADER_SIZE;
+	}
+	if(opened) index_cached = f_close(&sidecar) == FR_OK && writing;
+}
+
+/*write a 4-byte little-endian number*/
+void put_long(uint8_t* bytes, uint32_t number){
+	uint8_t i;
+	for(i=0;i<4;i++){
+		bytes[i] = number;
+		number >>= 8;
+	}
+}
+
+/*read a 4-byte little-endian number*/
+uint32_t get_long(uint8_t* bytes){
+	return bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+/*get the number of tunes found by abc_index_file()*/
+uint8_t abc_tune_count(void){
+	return tune_count;
+}
+
+/*get the "X:" number of the tune at the given index*/
+uint16_t abc_tune_number(uint8_t index){
+	return index < tune_count ? tune_index[index].number : 0;
+}
+
+/* copy the title of the tune at the given index into buffer, which is size bytes long. the title comes from the sidecar file if there
+ * is one, and otherwise from the header of the tune itself
+ */
+FRESULT abc_tune_title(uint8_t index, char* buffer, uint8_t size){
+	FIL in;
+	FRESULT result;
+	UINT read;
+	struct ReaderState saved;
+	if(index >= tune_count || !size) return FR_INVALID_PARAMETER;
+	buffer[0] = '\0';
+	if(index_cached){
+		char sidecar_name[INDEX_PATH_SIZE];
+		index_sidecar_name(sidecar_name);
+		result = f_open(&in, sidecar_name, FA_READ);
+		if(result != FR_OK) return result;
+		result = f_lseek(&in, INDEX_HEADER_SIZE + (uint32_t)index*INDEX_RECORD_SIZE + 6);
+		if(result == FR_OK) result = f_read(&in, buffer, size < INDEX_TITLE_SIZE ? size : INDEX_TITLE_SIZE, &read);
+		buffer[size-1] = '\0';
+		f_close(&in);
+		return result;
+	}
+	/*no sidecar file, so read the header lines of the tune until its title*/
+	borrow_reader(&saved);
+	result = f_open(&reader->file, index_path, FA_READ);
+	if(result == FR_OK){
+		use_link_map(&reader->file);
+		result = f_lseek(&reader->file, tune_index[index].offset);
+	}
+	if(result == FR_OK){
+		current_char = file_getc();
+		while(at_field_line()){
+			read_field();
+			if(field[0]=='T'){
+				strncpy(buffer, field+2, size-1);
+				buffer[size-1] = '\0';
 				break;
 			}
+			if(current_char>=0) current_char = file_getc();
 		}
 	}
+	return_reader(&saved);
 	return result;
 }
 
+/*load the tune with the given "X:" number from the file indexed by abc_index_file(); FR_NO_FILE if there isn't one*/
+FRESULT abc_load_tune(uint16_t number){
+	uint8_t i;
+	for(i=0;i<tune_count;i++){
+		if(tune_index[i].number==number) return load_song(index_path, tune_index[i].offset);
+	}
+	return FR_NO_FILE;
+}
+
 /* if a note has been read and is waiting ot be played, play it */
 uint8_t playNoteIfAvailable(void){
 	if(note_flags & rest || (next_note!=0xFF)){ /*if either the next note is a rest, or the pitch of the next note is known*/
+		uint32_t scaled = 0;
+		/*broken rhythm: "a>b" plays a for 3/2 of its length and b for 1/2 of its length ("a<b" is the other way round).
+		  each extra '>' halves the shorter note again, and the longer one gets what it loses ("a>>b" is 7/4 and 1/4)*/
+		if(broken_rhythm > 0){
+			length = (length * ((2 << broken_rhythm) - 1)) >> broken_rhythm;
+		}else if(broken_rhythm < 0){
+			length >>= -broken_rhythm;
+		}
+		/*tuplets: play the note for q/p of its length. what's left over from the division is carried on to the next note of the tuplet,
+		  so the whole tuplet takes exactly q/p of the time its notes would have done*/
+		if(tuplet_notes){
+			scaled = length * tuplet_q + tuplet_remainder;
+			length = scaled / tuplet_p;
+		}
+		if(length==0) length=1; /*don't skip the note altogether if it's too short*/
 		/*set the time until another note is read and played as follows:
 		 *if the next note is a rest, use the rest's length
 		 *else
@@ -344,9 +1433,15 @@ uint8_t playNoteIfAvailable(void){
 		 *  else leave time_until_next_note as it is
 		*/
 		time_until_next_note = note_flags & rest ? length : (length < time_until_next_note ? length : time_until_next_note);
-		/*play the note, accounting for sharp/flat signs before it*/
-		channel_play(next_note + accidental_shift, length); 
+		/*queue the note, accounting for sharp/flat signs before it. rests (and notes off the end of the keyboard) can't be heard, so they're left out*/
+		uint8_t note = next_note + accidental_shift;
+		if(note < NOTES) queue_event(note, length);
 		if(!(note_flags & chord)){
+			/*the note (or chord) is complete, so it counts towards the tuplet and decides how long the note after it is*/
+			if(tuplet_notes){
+				tuplet_remainder = --tuplet_notes ? scaled % tuplet_p : 0;
+			}
+			broken_rhythm_next = note_flags & broken ? -broken_rhythm : 0;
 			return 1;
 		}else{ 
 			/*if the note is part of a chord, reset temporary variables for this node*/
@@ -359,143 +1454,735 @@ uint8_t playNoteIfAvailable(void){
 	return 0;	
 } 
 
-/*try to play the next note; if a note played and it wasn't part of a chord, break from the while loop*/
-#define playNoteOrBreak if(playNoteIfAvailable()) break;
+/*try to play the next note; if a note played and it wasn't part of a chord, stop reading (leaving this character for next time)*/
+#define playNoteOrBreak if(playNoteIfAvailable()){ note_read = 1; break; }
 
-/*play an entire abc file that has already been loaded*/
-void abc_play(void){
-	pwm_init();
-	abc_playing = ABC_PLAYING;
+/*advance the song by one tick: release finished notes and play the notes from the queue that are due*/
+void sequencer_tick(void){
+	uint8_t i;
+	/*update the timers of notes currently playing; and stop any that have counted down to 0*/
+	for(i=0;i<CHANNELS;i++){
+		if(channels[i].time_until_release) channels[i].time_until_release--;
+		if(!channels[i].time_until_release){ /*a note of duration d plays for exactly d ticks, so the next note can start on the same tick*/
+			channels[i].note=0xFF;
+			occupied_channels &= ~(1<<i);
+		}
+		/*if all notes have finished, and no more will be read in, then stop the song*/
+		if(!occupied_channels && abc_playing==ABC_FINISHING) abc_stop();
+	}
+	/*move a tempo ramp on by a tick*/
+	if(ramp_ticks){
+		ramp_ticks--;
+		ramp_length += ramp_step;
+		set_tick_length(ramp_ticks ? ramp_length >> 8 : ramp_target); /*land exactly on the target*/
+	}
+	/*play every event read from the file that is now due*/
+	while(queue_length && (int32_t)(song_tick - event_queue[queue_head].tick) >= 0){
+		struct Event* event = &event_queue[queue_head];
+		if(event->tick != song_tick) late_events++;
+#ifdef JPML_TRACE
+		abc_trace(song_tick, event->type, event->argument, event->voice);
+#endif
+		if(event->type < NOTES){
+			play_on(event->type, event->argument, event->voice < CHANNELS ? event->voice : 0);
+		}else if(event->type==BIN_WAVE){
+			if((event->argument >> 4) < CHANNELS) channels[event->argument >> 4].wave = event->argument & 0x0F;
+		}else if(event->type==BIN_TEMPO){ /*the tick after this one is the new length*/
+			ramp_ticks = 0;
+			set_tick_length(event->argument);
+		}else if(event->type==BIN_END){ /*no more notes, so finish once the last ones have been released*/
+			abc_playing = ABC_FINISHING;
+		}
+		queue_head = (queue_head + 1) & (EVENT_QUEUE_SIZE - 1);
+		queue_length--;
+	}
+	song_tick++;
+}
 
-	uint8_t i=0;
-	while(abc_playing){
-		if(bpmCounter>bpmLimit){ /*if the timer is large enough to count as a tick*/
-			cli();
-			/*update the timers of notes currently playing; and stop any that have counted down to 0*/
-			for(i=0;i<CHANNELS;i++){
-				if(!channels[i].time_until_release){
-					channels[i].note=0xFF;
-					occupied_channels &= ~(1<<i);
+/* read the next note (or chord) from the abc file into the queue, timed at parse_tick, and work out when the one after it is due.
+ * the next note is due exactly the shortest length of the notes read (or the rest's length) later, so lengths never lose or gain a tick
+ */
+void read_notes(void){
+	uint8_t char_class; /*what current_char means; see notes.h*/
+	uint8_t note_read = 0; /*set once a note (or chord) has been read, or there's nothing left to read*/
+	/*initialise all temporary variables*/
+	time_until_next_note=0xFFFF;
+	broken_rhythm = broken_rhythm_next;
+	note_flags = 0;
+	accidental_shift = 0;
+	numstring[0]='\0';
+	length = default_note_length;
+	next_note = 0xFF;
+	number_mode = 0;
+	/*continuously read characters from the file and queue them accordingly, until a note (or chord) has been read*/
+	while(!note_read){
+		if(current_char<0){
+			char_class = CHAR_END_OF_LINE;
+		}else if(current_char<128){
+			char_class = pgm_read_byte(&abc_char_class[current_char]);
+		}else{
+			char_class = CHAR_OTHER;
+		}
+		if(number_mode && char_class!=CHAR_LENGTH){ /*if numbers were being read, but the current character isn't a number, deal with that number:*/
+			number_mode = 0;
+			/*convert numstring to a note length, as a fraction of the default note length for this song*/
+			length = string_to_note_length(numstring, default_note_length);
+			continue; /*read this character again now the number has been dealt with*/
+		}
+		switch(char_class){
+			case(CHAR_LENGTH):
+				/*store the current character in a string, to deal with later when the entire number has been read*/
+				if(number_mode < (int8_t)sizeof(numstring)-1){
+					numstring[number_mode++]=current_char;
+					numstring[number_mode]='\0';
+				}
+				break;
+			case(CHAR_NOTE):
+				/*capital letters are used for notes G4 and under*/
+				playNoteOrBreak
+				if(note_flags & natural){
+					next_note = pgm_read_byte(&C_MAJOR[current_char - 'A']);
 				}else{
-					channels[i].time_until_release--;
+					next_note = key_signature[current_char - 'A'];
 				}
-				/*if all notes have finished, and no more will be read in, then stop the song*/
-				if(!occupied_channels && abc_playing==ABC_FINISHING) abc_stop();
-			}
-			/*if it's time to play the next note, do so:*/
-			if(abc_playing==ABC_PLAYING && !time_until_next_note){
-				/*initialise all temporary variables*/
-				time_until_next_note=0xFF;
-				note_flags = 0;
-				accidental_shift = 0;
-				numstring[0]='\0';
-				length = default_note_length;
-				next_note = 0xFF;
-				number_mode = 0;
-				/*continuously read characters from the file and play them accordingly*/
-				while(1){
-					/*if the current character is either a number or a forward slash, then it represents a note length*/
-					if(readlinebuffer[readline_index] >= '/' && readlinebuffer[readline_index] <= '9'){
-						/*store the current character in a string, to deal with later when the entire number has been read*/
-						if(!number_mode) number_mode=readline_index;
-						numstring[readline_index-number_mode]=readlinebuffer[readline_index];
-						numstring[readline_index-number_mode+1]='\0';
+				break;
+			case(CHAR_NOTE_HIGH):
+				/*lowercase letters are used for notes A5 and up*/
+				playNoteOrBreak
+				if(note_flags & natural){
+					next_note = pgm_read_byte(&C_MAJOR[current_char - 'a']) + 12;
+				}else{
+					next_note = key_signature[current_char - 'a']+12;
+				}
+				break;
+			case(CHAR_OCTAVE_DOWN):
+				/*commas after a note decrease its pitch by an octave*/
+				if(next_note!=0xFF) next_note-=12;
+				break;
+			case(CHAR_OCTAVE_UP):
+				/*apostrophes after a note increase its pitch by an octave*/
+				if(next_note!=0xFF) next_note+=12;
+				break;
+			case(CHAR_FLAT):
+				/*underscores before a note decrease its pitch by a semitone*/
+				playNoteOrBreak
+				accidental_shift--;
+				break;
+			case(CHAR_SHARP):
+				/*circumflexes before a note increase its pitch by a semitone*/
+				playNoteOrBreak
+				accidental_shift++;
+				break;
+			case(CHAR_NATURAL):
+				/*equals signs before a note naturalise it (i.e. the note is taken from the C Major key rather than the song's current key)*/
+				playNoteOrBreak
+				note_flags |= natural;
+				break;
+			case(CHAR_END_OF_LINE):
+				/*if the end of a line or start of a comment is reached, move on to the next line*/
+				if(current_char=='%') skip_line();
+				start_line();
+				if(current_char<0){ /*if there's nothing left of this voice, the song finishes once every voice has been played*/
+					end_voice();
+					note_read = 1;
+				}
+				continue; /*current_char is already the first character of the line*/
+			case(CHAR_SEPARATOR):
+				/*spaces are never part of a note; so try to play a note if one has already been loaded*/
+				playNoteOrBreak
+				break;
+			case(CHAR_BAR):
+				/*neither are bar lines, but they can send the reader somewhere else in the file*/
+				playNoteOrBreak
+				read_bar();
+				count_bar();
+				if(skipping && bar_number>=skip_to_bar) return; /*abc_seek_bar() has found its bar*/
+				continue; /*current_char is already the first character after the bar line*/
+			case(CHAR_CHORD_START):
+				/*start of a chord (notes played simultaneously appear in square brackets)*/
+				playNoteOrBreak
+				if(file_peek()>='1' && file_peek()<='9'){ /*"[1" or "[2" isn't a chord but the start of an ending*/
+					read_bar();
+					count_bar();
+					if(skipping && bar_number>=skip_to_bar) return;
+					continue;
+				}
+				if(file_peek()>='H' && file_peek()<='Z'){ /*nor is "[K:D]" (notes are A to G)*/
+					read_inline_field();
+					continue;
+				}
+				note_flags |= chord;
+				break;
+			case(CHAR_CHORD_END):
+				/*end of a chord*/
+				if(note_flags & chord) note_flags &= ~chord;
+				next_char();
+				playNoteOrBreak
+				break;
+			case(CHAR_REST):
+				/*z and x indicate rests - i.e. a period of silence instead of a note*/
+				playNoteOrBreak
+				note_flags |= rest;
+				break;
+			case(CHAR_TIE):
+				/*ignore ties*/
+				break;
+			case(CHAR_BROKEN):
+				/*'>' or '<' straight after a note (or rest) changes its length and the next one's; see playNoteIfAvailable()*/
+				if(!(note_flags & chord) && (note_flags & rest || next_note!=0xFF)){
+					if(!(note_flags & broken)){
+						note_flags |= broken;
+						broken_rhythm = 0; /*forget about the note before this one*/
+					}
+					if(current_char=='>'){
+						if(broken_rhythm < 3) broken_rhythm++;
 					}else{
-						if(number_mode){ /*if numbers were being read, but the current character isn't a number, deal with that number:*/
-							number_mode = 0;
-							/*convert numstring to a note length and scale it according to the default note length for this song*/
-							length = (string_to_note_length(numstring) * default_note_length) >> 5; 
-							if(length==0) length=1; /*don't skip the entire song if the note length is too small*/
-							if(note_flags & rest) length*=1.5; /*rests finish much faster than notes; this counters that*/
-							readline_index--; /*undo the increment later so we can read this character again*/
-						}else if(readlinebuffer[readline_index]>='A' && readlinebuffer[readline_index]<='G'){
-							/*capital letters are used for notes G4 and under*/
-							playNoteOrBreak
-							if(note_flags & natural){
-								next_note = C_MAJOR[readlinebuffer[readline_index] - 'A'];
-							}else{
-								next_note = key_signature[readlinebuffer[readline_index] - 'A'];
-							}
-						}else if(readlinebuffer[readline_index]>='a' && readlinebuffer[readline_index]<='g'){
-							/*lowercase letters are used for notes A5 and up*/
-							playNoteOrBreak
-							if(note_flags & natural){
-								next_note = C_MAJOR[readlinebuffer[readline_index] - 'a'] + 12;
-							}else{
-								next_note = key_signature[readlinebuffer[readline_index] - 'a']+12;
-							}
-						}else if(readlinebuffer[readline_index]==','){
-							/*commas after a note decrease its pitch by an octave*/
-							if(next_note!=0xFF) next_note-=12;
-						}else if(readlinebuffer[readline_index]=='\''){
-							/*apostrophes after a note increase its pitch by an octave*/
-							if(next_note!=0xFF) next_note+=12;
-						}else if(readlinebuffer[readline_index]=='_'){
-							/*underscores before a note decrease its pitch by a semitone*/
-							playNoteOrBreak
-							accidental_shift--;
-						}else if(readlinebuffer[readline_index]=='^'){
-							/*circumflexes before a note increase its pitch by a semitone*/
-							playNoteOrBreak
-							accidental_shift++;
-						}else if(readlinebuffer[readline_index]=='='){
-							/*equals signs before a note naturalise it (i.e. the note is taken from the C Major key rather than the song's current key)*/
-							playNoteOrBreak
-							note_flags |= natural;
-						}else if(readlinebuffer[readline_index]=='\0' || readlinebuffer[readline_index]=='%'){
-							/*if the end of a line or start of a comment is reached, read the next line*/
-							do{
-								readlinebuffer=f_gets(readlinebuffer, LINE_BUFFER_SIZE, &file);
-								readline_index=-1; /*it'll be incremented to 0 momentarily*/
-								/*some header things can also appear in the middle of music. deal with these:*/
-								if(readlinebuffer[1]==':'){
-									switch(readlinebuffer[0]){
-										case('K'): /*key signature*/
-											changeKey(readlinebuffer+2);
-											break;
-										case('I'): /*'instruction' (used to change a channel's waveform)*/
-											parse_lf_tag(readlinebuffer+2);
-											break;
-										default:;
-									}
-								}
-							}while(readlinebuffer && readlinebuffer[1]==':'); /*keep reading until there isn't a header-like line*/
-							if(!readlinebuffer){ /*if nothing was read, prepare to stop playback*/
-								abc_playing = ABC_FINISHING;
-								break;
-							}
-						}else if(readlinebuffer[readline_index]==' ' || readlinebuffer[readline_index]=='|'){
-							/*spaces or bars are never part of a note; so try to play a note if one has already been loaded*/
-							playNoteOrBreak
-						}else if(readlinebuffer[readline_index]=='['){
-							/*start of a chord (notes played simultaneously appear in square brackets)*/
-							playNoteOrBreak
-							note_flags |= chord;
-						}else if(readlinebuffer[readline_index]==']'){
-							/*end of a chord*/
-							if(note_flags & chord) note_flags &= ~chord;
-							readline_index++;
-							playNoteOrBreak
-						}else if(readlinebuffer[readline_index]=='z' || readlinebuffer[readline_index]=='x'){
-							/*z and x indicate rests - i.e. a period of silence instead of a note*/
-							playNoteOrBreak
-							else note_flags |= rest;
-						}else if(readlinebuffer[readline_index]=='-'){
-							/*ignore ties*/
-						}else{ /*not part of a note*/
-							playNoteOrBreak
-						}
+						if(broken_rhythm > -3) broken_rhythm--;
 					}
-					readline_index++;
 				}
-			}else{
-				time_until_next_note--;
+				break;
+			case(CHAR_TUPLET):
+				/*'(' starts a tuplet if a digit follows it, or a slur (which makes no difference here) if not*/
+				playNoteOrBreak
+				next_char();
+				if(current_char>='2' && current_char<='9') read_tuplet();
+				continue; /*current_char is already the first character after the '(' (or the tuplet)*/
+			default: /*not part of a note*/
+				playNoteOrBreak
+		}
+		if(!note_read) next_char();
+	}
+	/*the next notes are due time_until_next_note ticks after these ones*/
+	if(reader->reading) parse_tick += time_until_next_note;
+}
+
+/* read a bar line starting at current_char, and follow any repeat marks in it, leaving current_char at the first character after it
+ * (which may be somewhere else in the file):
+ *	"|:" starts a section to be repeated
+ *	":|" goes back to the start of the section the first time it's reached, and carries on the second time.
+ *	if there's no "|:" before it, the section starts after the last ":|" (or at the start of the tune)
+ *	"::" or ":|:" does both
+ *	"|1" or "[1" starts the first ending, which is skipped the second time through: "|: A |1 B :|2 C ||" plays A B A C
+ */
+void read_bar(void){
+	uint8_t end_repeat = 0, start_repeat = 0, ending = 0;
+	while(current_char==':'){
+		end_repeat = 1;
+		next_char();
+	}
+	while(current_char=='|') next_char();
+	while(current_char==':'){
+		start_repeat = 1;
+		next_char();
+	}
+	if(current_char=='[' && file_peek()>='1' && file_peek()<='9') next_char(); /*"|[1" is the same as "|1"*/
+	if(current_char>='1' && current_char<='9'){
+		ending = current_char - '0';
+		next_char();
+	}
+	if(end_repeat){
+		if(!repeat_pass){
+			repeat_pass = 1;
+			seek_char(repeat_start);
+			memcpy(key_signature, repeat_key, sizeof(key_signature)); /*back in the key the section started in*/
+			return;
+		}
+		/*the section has been played twice; anything after this is a new one*/
+		repeat_pass = 0;
+		start_section();
+	}
+	if(start_repeat){
+		repeat_pass = 0;
+		start_section();
+	}
+	if(ending==1 && repeat_pass) skip_ending();
+}
+
+/*start a new section at current_char, in the current key: a ":|" after it goes back to here*/
+void start_section(void){
+	repeat_start = char_offset();
+	memcpy(repeat_key, key_signature, sizeof(key_signature));
+}
+
+/*skip the first ending the second time through a section: everything up to and including the ":|" at the end of it*/
+void skip_ending(void){
+	while(current_char>=0 && current_char!=':'){
+		if(current_char=='\0'){ /*header lines and comments can have colons in them too*/
+			start_line();
+			continue;
+		}
+		if(current_char=='%') skip_line();
+		if(current_char=='[' && file_peek()>='H' && file_peek()<='Z'){ /*and so can inline fields*/
+			while(current_char>0 && current_char!=']') next_char();
+		}
+		next_char();
+	}
+	if(current_char>=0) read_bar(); /*repeat_pass is 1, so this finishes the section rather than going back again*/
+}
+
+/*get the offset of current_char in the file*/
+uint32_t char_offset(void){
+	return f_tell(&reader->file) - reader->chunk_length + reader->chunk_index - 1;
+}
+
+/*carry on reading from the given offset in the file (which becomes current_char), keeping track of how long it takes*/
+void seek_char(uint32_t offset){
+	uint32_t start = song_time();
+	seek_file(offset);
+	repeat_seeks++;
+	seek_time += song_time() - start;
+}
+
+/*have seeks in the given file (just opened) use link_map, making it first if it's for a different file.
+  if the file is in more than SEEK_FRAGMENTS fragments, its seeks follow the FAT chain as usual*/
+void use_link_map(FIL* file){
+	if(link_map_cluster != file->sclust || link_map_size != file->fsize){
+		link_map_cluster = 0;
+		if(!file->sclust) return; /*an empty file*/
+		link_map[0] = sizeof(link_map) / sizeof(link_map[0]);
+		file->cltbl = link_map;
+		if(f_lseek(file, CREATE_LINKMAP) != FR_OK){
+			file->cltbl = 0;
+			return;
+		}
+		link_map_cluster = file->sclust;
+		link_map_size = file->fsize;
+	}
+	file->cltbl = link_map;
+}
+
+/*carry on reading from the given offset in the file, which becomes current_char*/
+void seek_file(uint32_t offset){
+	f_lseek(&reader->file, offset);
+	reader->chunk_length = 0; /*the chunk is from the old position*/
+	reader->chunk_index = 0;
+	current_char = file_getc();
+}
+
+/*a bar line has just been read: count it, and keep a checkpoint at the start of the bar after it if one is due*/
+void count_bar(void){
+	bar_number++;
+	if(checkpoint_count && !(bar_number % checkpoint_interval) && bar_number > checkpoints[checkpoint_count-1].bar) record_checkpoint();
+}
+
+/* keep the state of the reader at current_char as a checkpoint for bar_number. when there's no room for it, every other checkpoint
+ * is dropped (keeping the start of the song) and they're kept half as often from then on
+ */
+void record_checkpoint(void){
+	struct Checkpoint* checkpoint;
+	uint8_t i;
+	if(voice_count > 1 || current_char < 0) return;
+	if(checkpoint_count==CHECKPOINTS){
+		for(i=0;i<CHECKPOINTS/2;i++) checkpoints[i] = checkpoints[i*2];
+		checkpoint_count = CHECKPOINTS/2;
+		checkpoint_interval *= 2;
+		if(bar_number % checkpoint_interval) return; /*this bar isn't one of them any more*/
+	}
+	checkpoint = &checkpoints[checkpoint_count++];
+	checkpoint->offset = char_offset();
+	checkpoint->bar = bar_number;
+	memcpy(checkpoint->key_signature, key_signature, sizeof(key_signature));
+	checkpoint->tick = parse_tick + tick_base;
+	checkpoint->tempo = parse_tick_length;
+	checkpoint->default_note_length = default_note_length;
+	memcpy(checkpoint->waves, parse_wave, sizeof(parse_wave));
+	checkpoint->repeat_start = repeat_start;
+	checkpoint->repeat_pass = repeat_pass;
+	memcpy(checkpoint->repeat_key, repeat_key, sizeof(repeat_key));
+}
+
+/* carry on from the start of the given bar (the number of bar lines before it, counting repeated bars again), as if the song had
+ * been played up to there: the notes playing now are stopped, and the next note is the first of the bar. this only has to read from
+ * the last checkpoint before the bar rather than from the start of the song. a tempo ramp carries on if the bar is part of it.
+ * returns FR_DENIED for compiled songs and songs with more than one voice, and FR_INVALID_PARAMETER if the song has fewer bars
+ * (in which case it finishes straight away)
+ */
+FRESULT abc_seek_bar(uint16_t bar){
+	struct Checkpoint* checkpoint;
+	uint32_t position, done;
+	uint8_t i;
+	if(song_format!=FORMAT_ABC || voice_count > 1 || !checkpoint_count) return FR_DENIED;
+	/*stop what's playing, and forget what's been read ahead*/
+	for(i=0;i<CHANNELS;i++){
+		channels[i].note=0xFF;
+		channels[i].time_until_release=0;
+	}
+	occupied_channels = 0;
+	queue_length = 0;
+	ramp_ticks = 0;
+	/*go back to the last checkpoint at or before the bar*/
+	for(i=checkpoint_count-1;checkpoints[i].bar > bar;i--);
+	checkpoint = &checkpoints[i];
+	seek_file(checkpoint->offset);
+	bar_number = checkpoint->bar;
+	memcpy(key_signature, checkpoint->key_signature, sizeof(key_signature));
+	parse_tick_length = checkpoint->tempo;
+	tick_base = checkpoint->tick - parse_tick;
+	default_note_length = checkpoint->default_note_length;
+	memcpy(parse_wave, checkpoint->waves, sizeof(parse_wave));
+	repeat_start = checkpoint->repeat_start;
+	repeat_pass = checkpoint->repeat_pass;
+	memcpy(repeat_key, checkpoint->repeat_key, sizeof(repeat_key));
+	time_until_next_note = 0;
+	broken_rhythm_next = 0;
+	tuplet_notes = 0;
+	reader->reading = 1;
+	reading_file = 1;
+	/*read through the bars before the one wanted without queueing anything (keeping checkpoints on the way)*/
+	skipping = 1;
+	skip_to_bar = bar;
+	while(reading_file && bar_number < bar) read_notes();
+	skipping = 0;
+	time_until_next_note = 0;
+	for(i=0;i<CHANNELS;i++) channels[i].wave = parse_wave[i];
+	position = parse_tick + tick_base;
+	parse_tick = abc_playing ? song_tick : 0; /*abc_start() starts the song clock from 0*/
+	tick_base = position - parse_tick;
+	if(position < ramp_start_tick) ramp_stop_tick = ramp_start_tick; /*going back to before the ramp started cancels it*/
+	done = position - ramp_start_tick;
+	if(position < ramp_stop_tick && done < ramp_total){ /*the bar is part of the ramp, so carry on with it*/
+		ramp_length = ramp_start_length + ramp_step * (int32_t)done;
+		ramp_ticks = ramp_total - done;
+	}
+	set_tick_length(position_tick_length(position)); /*the tempo the bar would have been played at*/
+	if(!reading_file){
+		queue_event(BIN_END, 0);
+		return FR_INVALID_PARAMETER;
+	}
+	if(abc_playing){
+		abc_playing = ABC_PLAYING; /*(in case it was finishing)*/
+		while(read_ahead()); /*refill the queue so the bar starts on time*/
+	}
+	return FR_OK;
+}
+
+/* read a tuplet, starting at the digit after the '(': "(p" plays the next p notes in the time of q, where q is 3 for p = 2, 4 or 8
+ * and 2 otherwise (abc makes q depend on the meter for p = 5, 7 or 9, but this reader doesn't know the meter, so it goes by simple time).
+ * "(p:q:r" plays the next r notes p in the time of q; q and r are optional ("(p:q", "(p::r")
+ */
+void read_tuplet(void){
+	tuplet_p = current_char - '0';
+	tuplet_q = (tuplet_p==2 || tuplet_p==4 || tuplet_p==8) ? 3 : 2;
+	tuplet_notes = tuplet_p;
+	tuplet_remainder = 0;
+	next_char();
+	if(current_char!=':') return;
+	next_char();
+	if(current_char>='1' && current_char<='9'){
+		tuplet_q = current_char - '0';
+		next_char();
+	}
+	if(current_char!=':') return;
+	next_char();
+	if(current_char>='1' && current_char<='9'){
+		tuplet_notes = current_char - '0';
+		next_char();
+	}
+}
+
+/* if the file just opened is a song compiled by abc2bin, read its header and get ready to play it.
+ * returns HEADER_ABC (after going back to the start of the file) if it's an ordinary abc file,
+ * and HEADER_UNSUPPORTED if it was compiled for a different format version or TICKS_PER_WHOLE
+ */
+uint8_t bin_load_header(void){
+	uint8_t i;
+	int16_t c;
+	uint16_t tempo, beat_length;
+	reader->chunk_length = 0;
+	reader->chunk_index = 0;
+	/*the magic and version are always in the first chunk, so going back to the start of it goes back to the start of the file*/
+	for(i=0;i<BIN_MAGIC_SIZE;i++){
+		if(file_getc()!=BIN_MAGIC[i]){
+			reader->chunk_index = 0;
+			return HEADER_ABC;
+		}
+	}
+	if(file_getc()!=BIN_VERSION) return HEADER_UNSUPPORTED; /*a different format than this player understands*/
+	if(bin_read_word()!=TICKS_PER_WHOLE) return HEADER_UNSUPPORTED; /*every note would be the wrong length*/
+	tempo = bin_read_word();
+	beat_length = bin_read_word();
+	if(tempo) set_tempo_beat(tempo, beat_length);
+	/*the title is nul-terminated and abc2bin keeps it shorter than BIN_TITLE_SIZE*/
+	for(i=0;i<FIELD_SIZE-1;i++){
+		c = file_getc();
+		if(c<=0) break;
+		field[i] = c;
+	}
+	field[i] = '\0';
+	if(title) free(title);
+	title = malloc(sizeof(char)*(i+1));
+	strcpy(title, field);
+	parse_tick = bin_read_number(); /*the first event is timed from the start of the song*/
+	song_format = FORMAT_BINARY;
+	return HEADER_COMPILED;
+}
+
+/*read a 2-byte little-endian number from the header of a compiled song*/
+uint16_t bin_read_word(void){
+	uint16_t word = file_getc() & 0xFF;
+	return word | (file_getc() & 0xFF) << 8;
+}
+
+/* get the next byte of the file, reading the next chunk of it when needed; -1 at the end of the file.
+ * a chunk is normally the rest of a sector, read in place by f_window() rather than copied out with f_read(). fatfs's one sector
+ * buffer is shared with the FAT (and anything else the program reads), so if something else has had it since, the sector is put
+ * back first, usually from the sector cache; that's checked when the reader changes, and again after anything (including the program
+ * between calls to abc_poll()) could have used fatfs, which clears window_reader. the voices of a tune read close together but take
+ * turns every few notes, so they would keep putting back each other's sectors; they copy out FILE_CHUNK_SIZE bytes at a time instead
+ */
+int16_t file_getc(void){
+	if(reader->chunk_index==reader->chunk_length){
+		UINT read, size = _MAX_SS;
+		FRESULT result;
+		if(f_tell(&reader->file) >= tune_end) return -1;
+		if(tune_end - f_tell(&reader->file) < size) size = tune_end - f_tell(&reader->file); /*stop at the end of the tune*/
+		if(pwm_in_use) pwm_render(); /*reading from the sd card can take a while, so keep ISR1 fed*/
+		if(voice_count > 1){
+			result = f_read(&reader->file, reader->copy, size < FILE_CHUNK_SIZE ? size : FILE_CHUNK_SIZE, &read);
+			reader->chunk = reader->copy;
+		}else{
+			result = f_window(&reader->file, &reader->chunk, size, &read);
+		}
+		if(result!=FR_OK || !read) return -1;
+		reader->chunk_length = read;
+		reader->chunk_index = 0;
+		window_reader = reader;
+	}else if(reader!=window_reader){
+		if(reader->chunk!=reader->copy && !f_inwindow(&reader->file)){
+			if(pwm_in_use) pwm_render();
+			if(f_reload(&reader->file)!=FR_OK) return -1;
+		}
+		window_reader = reader;
+	}
+	return reader->chunk[reader->chunk_index++];
+}
+
+/*get the next byte of the file without moving on from it; -1 at the end of the file*/
+int16_t file_peek(void){
+	int16_t c = file_getc();
+	if(c>=0) reader->chunk_index--; /*it's still in the chunk, even if the chunk has just been read*/
+	return c;
+}
+
+/*move on to the next character of the abc file. the end of each line reads as '\0' first, as it did when the file was read a line at a time*/
+void next_char(void){
+	current_char = current_char=='\n' ? '\0' : file_getc();
+}
+
+/*whether the line starting at current_char is a header line ("x:...", where x is a letter; so a line starting with "|:" is still music)*/
+uint8_t at_field_line(void){
+	return ((current_char>='A' && current_char<='Z') || (current_char>='a' && current_char<='z')) && file_peek()==':';
+}
+
+/*read the rest of the current line into field (as much of it as fits), leaving current_char at the end of the line*/
+void read_field(void){
+	uint8_t i = 0;
+	while(current_char>=0 && current_char!='\n'){
+		if(i<FIELD_SIZE-1 && current_char!='\r') field[i++] = current_char;
+		current_char = file_getc();
+	}
+	field[i] = '\0';
+}
+
+/*skip the rest of the current line (e.g. a comment), leaving current_char at the end of the line*/
+void skip_line(void){
+	while(current_char>=0 && current_char!='\n') current_char = file_getc();
+}
+
+/*move on to the first character of the next line, dealing with the header lines that can also appear in the middle of the music*/
+void start_line(void){
+	uint32_t offset;
+	while(1){
+		if(current_char>=0) current_char = file_getc();
+		if(!at_field_line()) return;
+		offset = char_offset();
+		read_field();
+		switch(field[0]){
+			case('X'): /*the start of the next tune*/
+				end_tune(offset);
+				return;
+			case('V'): /*the music after this belongs to another voice, which has its own reader*/
+				if(voice_count && find_voice(field+2)!=reading_voice) skip_voice();
+				break;
+			default:
+				body_field();
+		}
+	}
+}
+
+/*deal with a header line in field that can also appear in the body of the tune, either on a line of its own or inline ("[K:D]")*/
+void body_field(void){
+	switch(field[0]){
+		case('K'): /*key signature*/
+			changeKey(field+2);
+			break;
+		case('I'): /*'instruction' (used to change a channel's waveform)*/
+			parse_lf_tag(field+2);
+			break;
+		case('Q'): /*tempo, which changes once the notes before it have been played*/
+			stop_ramp(parse_tick + tick_base);
+			parse_tick_length = parse_tempo(field+2);
+			queue_event(BIN_TEMPO, parse_tick_length);
+			break;
+		default:;
+	}
+}
+
+/*read an inline field ("[Q:1/4=120]") starting at its '[' into field and deal with it, leaving current_char at the first character after the ']'*/
+void read_inline_field(void){
+	uint8_t i = 0;
+	next_char();
+	while(current_char>0 && current_char!=']' && current_char!='\n'){
+		if(i<FIELD_SIZE-1) field[i++] = current_char;
+		next_char();
+	}
+	field[i] = '\0';
+	if(current_char==']') next_char();
+	body_field();
+}
+
+/*read a delta time or event argument of a compiled song: 7 bits per byte, most significant first, top bit set on all but the last byte*/
+uint32_t bin_read_number(void){
+	uint32_t number = 0;
+	int16_t c;
+	do{
+		c = file_getc();
+		if(c<0) break; /*the next file_getc() will find the end of the file too, and finish the song*/
+		number = (number << 7) | (c & 0x7F);
+	}while(c & 0x80);
+	return number;
+}
+
+/*read the next event of a compiled song into the queue*/
+void bin_read_event(void){
+	int16_t event;
+	uint16_t argument;
+	event = file_getc();
+	if(event<0 || event==BIN_END){
+		queue_event(BIN_END, 0);
+		reading_file = 0;
+		return;
+	}
+	argument = bin_read_number();
+	if(event<NOTES || event==BIN_WAVE || event==BIN_TEMPO) queue_event(event, argument);
+	else if(event==BIN_VOICE) event_voice = argument < VOICES ? argument : 0; /*anything newer is skipped*/
+	parse_tick += bin_read_number();
+}
+
+/* add an event, due at parse_tick, to the end of the queue.
+ * the last space is kept for BIN_END so that the song always finishes; notes that don't fit are dropped
+ */
+void queue_event(uint8_t type, uint16_t argument){
+	struct Event* event;
+	if(skipping) return;
+	if(queue_length >= EVENT_QUEUE_SIZE-1 && type!=BIN_END){
+		notes_dropped++;
+		return;
+	}
+	event = &event_queue[(queue_head + queue_length) & (EVENT_QUEUE_SIZE - 1)];
+	event->tick = parse_tick;
+	event->type = type;
+	event->argument = argument;
+	event->voice = event_voice;
+	queue_length++;
+	if(queue_length > queue_high_water) queue_high_water = queue_length;
+}
+
+/*read the next note (or chord) from the file into the queue, if there's room for it. returns 0 if there was nothing to do*/
+uint8_t read_ahead(void){
+	if(!reading_file || queue_length > EVENT_QUEUE_SIZE - READ_AHEAD_ROOM) return 0;
+	window_reader = 0; /*the program may have used fatfs since the last call*/
+	if(song_format==FORMAT_BINARY){
+		bin_read_event();
+	}else{
+		if(voice_count > 1) switch_voice(earliest_voice()); /*keep the queue in order by reading the voice that's furthest behind*/
+		read_notes();
+	}
+	return 1;
+}
+
+/*start playing the currently loaded song; returns straight away, so call abc_poll() regularly to keep it going*/
+void abc_start(void){
+	pwm_init();
+	idle_polls = 0;
+	notes_stolen = 0;
+	notes_dropped = 0;
+	late_events = 0;
+	song_tick = 0;
+	abc_playing = ABC_PLAYING;
+	while(read_ahead()); /*fill the queue before the first tick*/
+	sequencer_init();
+}
+
+/*keep the sample blocks full, and run the sequencer if a tick is due; otherwise read ahead. returns 0 once the song has finished*/
+uint8_t abc_poll(void){
+	if(abc_playing) pwm_render();
+	if(abc_playing && tick_due){ /*if ISR0 has marked the end of a tick*/
+		tick_due = 0;
+		uint32_t now = song_time();
+		/*deal with every tick that's due, so that a tick which overruns doesn't push the rest of the song back*/
+		while(abc_playing && (int32_t)(now - tick_time) >= 0){
+			uint32_t lateness = now - tick_time;
+			lateness_total += lateness;
+			if(lateness > lateness_max) lateness_max = lateness;
+			pwm_render();
+			sequencer_tick();
+			ATOMIC_BLOCK(ATOMIC_RESTORESTATE){ /*ISR0 reads tick_time*/
+				tick_time += bpmLimit;
 			}
-			bpmCounter=0;
-			sei();
 		}
+		idle_polls_last_tick = idle_polls;
+		idle_polls = 0;
+	}else if(!(abc_playing && read_ahead()) && idle_polls!=0xFFFF){ /*read ahead while there's nothing else to do*/
+		idle_polls++;
 	}
+	return abc_playing;
+}
+
+/*play an entire abc file that has already been loaded; blocks until the song is finished*/
+void abc_play(void){
+	abc_start();
+	while(abc_poll());
+}
+
+/*get how many times abc_poll() returned without doing anything during the last tick (i.e. how much spare time there is between ticks)*/
+uint16_t abc_idle_polls(void){
+	return idle_polls_last_tick;
+}
+
+/*get the total lateness of every tick since the song started, in timer 0 counts (1 count = 32us)*/
+uint32_t abc_drift(void){
+	return lateness_total;
+}
 
+/*get the lateness of the latest tick since the song started, in timer 0 counts (1 count = 32us)*/
+uint32_t abc_max_lateness(void){
+	return lateness_max;
+}
+
+/*get the number of events read from the file that are waiting to be played*/
+uint8_t abc_queue_depth(void){
+	return queue_length;
+}
+
+/*get the most events there have been in the queue at once since the song was loaded*/
+uint8_t abc_queue_high_water(void){
+	return queue_high_water;
+}
+
+/*get the number of events played late because they hadn't been read from the file in time*/
+uint16_t abc_late_events(void){
+	return late_events;
+}
+
+/*get the number of times the file has been seeked back to play a repeated section since the song was loaded*/
+uint16_t abc_repeat_seeks(void){
+	return repeat_seeks;
+}
+
+/*get the total time spent seeking back for repeats since the song was loaded, in timer 0 counts (1 count = 32us)*/
+uint32_t abc_seek_time(void){
+	return seek_time;
 }
 
 uint8_t abc_is_playing(){
@@ -505,16 +2192,17 @@ uint8_t abc_is_playing(){
 /*stop playback of an abc file*/
 void abc_stop(void) {
 	abc_playing=0;
+	sequencer_stop();
 	pwm_stop();
 }
 
-/*get the title of the song currently loaded*/
+/*get the title of the song currently loaded ("" if it doesn't have one)*/
 char* abc_song_title(void){
-	return title;
+	return title ? title : "";
 }
 
-/*convert a string of the form "n/d" for ints n,d into a number representing the number of 1/32nds of a bar for that interval*/
-uint16_t string_to_note_length(char *str){
+/*convert a string of the form "n/d" for ints n,d into the number of ticks in n/d of unit ticks (e.g. TICKS_PER_WHOLE for a fraction of a whole note)*/
+uint16_t string_to_note_length(char *str, uint16_t unit){
 	uint8_t i = 0;
 	uint8_t fraction = 0; /*number of slashes read so far*/
 	uint8_t no_numbers_set=1;
@@ -533,26 +2221,23 @@ uint16_t string_to_note_length(char *str){
 		}else if(str[i] >= '0' && str[i] <= '9'){
 			/*store digits in a string as they are being read*/
 			no_numbers_set=0;
-			current_number_string[current_number_position++]=str[i];
+			if(current_number_position<3) current_number_string[current_number_position++]=str[i];
 		}
 		i++;
 	}
 	current_number_string[current_number_position]='\0';
 	if(fraction){
-		if(no_numbers_set){
-			/*a lone slash is shorthand for 1/2; similarly "//"" = 1/4, "///" = 1/8, etc. */
-			n=1;
-			d=1 << fraction;
-		}else{ 
-			/*convert and store the denominator if there is one*/
-			d=atoi(current_number_string);
-		}
-	}else{
+		/*convert and store the denominator if there is one; a slash on its own halves the length, so "/" = 1/2, "3/" = 3/2, "//" = 1/4, etc.*/
+		d=current_number_position ? atoi(current_number_string) : 1 << fraction;
+		if(!d) d=1;
+	}else if(!no_numbers_set){
 		/*convert and store the numerator*/
 		n=atoi(current_number_string);
 	}
-	n*=32; /*lengths are expressed as multiples of 1/32nd of a bar*/
-	return n/d;
+	/*multiply before dividing so that the length is exact whenever unit divides by d*/
+	n*=unit;
+	n/=d;
+	return n > 0xFFFF ? 0xFFFF : n;
 }
 
 /*change the song's current key signature*/
@@ -566,7 +2251,7 @@ void changeKey(char *keystring){
 	}
 	/*initialise the key at C Major*/
 	for(i=0;i<7;i++){
-		key_signature[i]=C_MAJOR[i];
+		key_signature[i]=pgm_read_byte(&C_MAJOR[i]);
 	}
 	uint8_t key = keystring[j+0]; /*a letter from A-G*/
 	uint8_t modifier = keystring[j+1]; /*either b for flat, # for sharp, or something we don't care about for natural*/
@@ -574,13 +2259,13 @@ void changeKey(char *keystring){
 	/*(see notes.h for an explanation of the algorithm below)*/
 	if(modifier=='b' || (key=='F' && modifier!='#')){ 
 		/*this key is generated by flattening notes*/
-		for(i = flat_signatures[key-'A'];i!=0xFF;i--){
-			key_signature[Cb_MAJOR[i]]--;
+		for(i = pgm_read_byte(&flat_signatures[key-'A']);i!=0xFF;i--){
+			key_signature[pgm_read_byte(&Cb_MAJOR[i])]--;
 		}
 	}else{
 		/*this key is generated by sharpening notes*/
-		for(i = sharp_signatures[key-'A'];i!=0xFF;i--){
-			key_signature[Cs_MAJOR[i]]++;
+		for(i = pgm_read_byte(&sharp_signatures[key-'A']);i!=0xFF;i--){
+			key_signature[pgm_read_byte(&Cs_MAJOR[i])]++;
 		}
 	}
 }
@@ -601,6 +2286,7 @@ void parse_lf_tag(char *tagstring){
 		if(tagstring[i]=='\0') return;
 	}
 	int8_t channel = tagstring[i]-'0';
+	if(channel >= CHANNELS) return;
 	i++;
 	/*second nubmer represents the waveform to use*/
 	while(tagstring[i]<'0' || tagstring[i]>'9'){
@@ -608,6 +2294,7 @@ void parse_lf_tag(char *tagstring){
 		if(tagstring[i]=='\0') return;
 	}
 	int8_t wave = tagstring[i]-'0';
-	/*update accordingly*/
-	channels[channel].wave=wave;
+	/*change it when the notes before it have been played*/
+	parse_wave[channel] = wave;
+	queue_event(BIN_WAVE, (channel << 4) | wave);
 }
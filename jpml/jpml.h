@@ -6,9 +6,9 @@
  *
  * Plays music from ABC notation files by generating mono PCM audio on pins OC3A (left audio channel) and OC1A (right audio channel)
  *
- * Waveform generation is done entirely on ISR1. 
- * ISR3 is used to increment the clock used for note on/off timing. 
- * ABC file parsing turned out to be too complex for an ISR, so unfortunately abc_play() blocks until the song is complete.
+ * Waveforms are rendered a block at a time by pwm_render() (which abc_poll() calls), and ISR1 just outputs the next sample of the current block. 
+ * ISR0 (timer 0 in CTC mode) marks each tick of the sequencer used for note on/off timing (TICKS_PER_WHOLE ticks to a whole note). 
+ * ABC file parsing turned out to be too complex for an ISR, so it is done by abc_poll() from the main loop (abc_play() simply calls it until the song is complete).
  *
  * Built upon the LaFortuna WAV audio library by arp1g13:
  * 	github.com/fatcookies/lafortuna-wav-lib
@@ -25,51 +25,93 @@
 
 /*dependencies*/
 #include <stdint.h>
+#include <avr/pgmspace.h>
 #include "ff.h"
 #include "notes.h"
 
-#define LINE_BUFFER_SIZE 1024 /*reduce this only if you can guarantee that lines in your ABC files will be less than 1024 characters in length*/
+/*number of notes that can play at once (1-8). set it with -DCHANNELS=n in CFLAGS to trade voices against sample rate;
+  build with -DJPML_BENCHMARK and use pwm_benchmark() to see what each voice costs*/
+#ifndef CHANNELS
+#define CHANNELS 3
+#endif
+
+/*how the channels are mixed together; set it with -DMIXER=... in CFLAGS*/
+#define MIX_AVERAGE 0 /*average the channels that are playing (divides every sample; volume jumps when notes start and stop)*/
+#define MIX_FIXED_GAIN 1 /*each channel gets a fixed 1/CHANNELS of the volume (no divide; notes keep the same volume)*/
+#define MIX_RECIPROCAL 2 /*average the channels using a table of reciprocals instead of dividing*/
+#ifndef MIXER
+#define MIXER MIX_AVERAGE
+#endif
+
+/*number of notes (and wave changes) that can be read from the file ahead of time; a power of 2 from 16 to 128. each takes 8 bytes of RAM.
+  use abc_queue_high_water() and abc_late_events() to see whether your songs need more*/
+#ifndef EVENT_QUEUE_SIZE
+#define EVENT_QUEUE_SIZE 32
+#endif
+#define READ_AHEAD_ROOM 8 /*free space in the queue needed before reading the next note or chord (bigger chords lose their last notes)*/
+
+/* abc_seek_bar() starts from the last checkpoint of the reader's state before the bar it's asked for. one is kept every CHECKPOINT_BARS bars
+   to begin with, and when all CHECKPOINTS of them are used up every other one is dropped and the gap between them doubles.
+   each takes 33 bytes of RAM, plus 1 per channel*/
+#ifndef CHECKPOINTS
+#define CHECKPOINTS 16
+#endif
+#ifndef CHECKPOINT_BARS
+#define CHECKPOINT_BARS 8
+#endif
+
+/*most "X:" tunes in one file that abc_index_file() keeps track of (1-255). each takes 6 bytes of RAM*/
+#ifndef TUNE_INDEX_SIZE
+#define TUNE_INDEX_SIZE 64
+#endif
+
+/*most fragments the song file can be in on the card for seeks to use FatFs's fast seek (its cluster link map) rather than following the
+  file's FAT chain from the start. each takes 8 bytes of RAM; a file in more fragments than this still plays, but seeks the slow way*/
+#ifndef SEEK_FRAGMENTS
+#define SEEK_FRAGMENTS 8
+#endif
+
+/*number of "V:" voices of a tune that can be played at once (1-8). each voice is read from the file separately and takes about 100 bytes of RAM.
+  voice n plays on channel n whenever it's free, so there's little point in having more voices than channels*/
+#ifndef VOICES
+#define VOICES 3
+#endif
+
+/*number of sequencer ticks in a whole note (semibreve); every note length is a whole number of ticks, so this decides which lengths are exact.
+  192 (the default) is exact for everything down to 1/64 notes, and for triplets down to 1/32 notes. a multiple of 32 from 32 to 384.
+  songs compiled by tools/abc2bin only play on a player with the same TICKS_PER_WHOLE*/
+#ifndef TICKS_PER_WHOLE
+#define TICKS_PER_WHOLE 192
+#endif
+#if TICKS_PER_WHOLE < 32 || TICKS_PER_WHOLE > 384 || TICKS_PER_WHOLE % 32
+#error "TICKS_PER_WHOLE must be a multiple of 32 from 32 to 384"
+#endif
+/*timer 0 counts (F_CPU/256 a second) in a tick when bpm beats of beat_length ticks are played per minute, to the nearest count*/
+#define TICK_LENGTH(bpm, beat_length) (((F_CPU / 256) * 60 + (uint32_t)(bpm) * (beat_length) / 2) / ((uint32_t)(bpm) * (beat_length)))
+
+#ifndef F_CPU
+#define F_CPU 8000000UL
+#endif
+
+#define SAMPLE_BLOCK_SIZE 32 /*number of samples rendered at a time; two blocks are buffered. larger blocks survive slower sd card reads but delay notes by up to a block*/
+#define PWM_PERIOD 256 /*cpu cycles per timer 1 overflow (8-bit fast pwm, no prescaling)*/
+#ifndef PWM_OVERFLOWS_PER_SAMPLE
+#define PWM_OVERFLOWS_PER_SAMPLE 8 /*number of timer 1 overflows per output sample. fewer gives a higher sample rate but more rendering*/
+#endif
+#define SAMPLE_RATE ((double)F_CPU / PWM_PERIOD / PWM_OVERFLOWS_PER_SAMPLE) /*3906.25Hz by default; note_step in notes.c is generated from this*/
 
 /*wave constants*/
 #define SINE 0
 #define TRIANGLE 1
 #define SQUARE 2
 #define SAWTOOTH 3
-/*lookup table for 256-point sine wave*/
-static uint8_t sine[256] = {
-	128,131,134,137,140,143,146,149,
-	152,155,158,162,165,167,170,173,
-	176,179,182,185,188,190,193,196,
-	198,201,203,206,208,211,213,215,
-	218,220,222,224,226,228,230,232,
-	234,235,237,238,240,241,243,244,
-	245,246,248,249,250,250,251,252,
-	253,253,254,254,254,255,255,255,
-	255,255,255,255,254,254,254,253,
-	253,252,251,250,250,249,248,246,
-	245,244,243,241,240,238,237,235,
-	234,232,230,228,226,224,222,220,
-	218,215,213,211,208,206,203,201,
-	198,196,193,190,188,185,182,179,
-	176,173,170,167,165,162,158,155,
-	152,149,146,143,140,137,134,131,
-	128,124,121,118,115,112,109,106,
-	103,100,97,93,90,88,85,82,
-	79,76,73,70,67,65,62,59,
-	57,54,52,49,47,44,42,40,
-	37,35,33,31,29,27,25,23,
-	21,20,18,17,15,14,12,11,
-	10,9,7,6,5,5,4,3,
-	2,2,1,1,1,0,0,0,
-	0,0,0,0,1,1,1,2,
-	2,3,4,5,5,6,7,9,
-	10,11,12,14,15,17,18,20,
-	21,23,25,27,29,31,33,35,
-	37,40,42,44,47,49,52,54,
-	57,59,62,65,67,70,73,76,
-	79,82,85,88,90,93,97,100,
-	103,106,109,112,115,118,121,124,
-};
+/*voice stealing policies: which note channel_play() replaces when all channels are playing*/
+#define STEAL_NONE 0 /*don't replace anything; the new note is dropped*/
+#define STEAL_OLDEST 1 /*replace the note that started first (default)*/
+#define STEAL_SHORTEST 2 /*replace the note with the least time left to play*/
+#define STEAL_PROTECT_LOWEST 3 /*replace the oldest note, but never the lowest one (keeps the bass line going)*/
+/*lookup table (in flash) for 256-point sine wave; read it with pgm_read_byte()*/
+extern const uint8_t sine[256] PROGMEM;
 
 /*
  * SYNTHESIZER FUNCTIONS
@@ -77,22 +119,50 @@ static uint8_t sine[256] = {
  * if you only want to play abc files, you can ignore these.
  * see the abc-playing bits of jpml.c for example usage
  */
-void pwm_init(); /*initialise timers 1 and 3*/
+void pwm_init(); /*initialise timers 1 and 3 (timer 0 is set up separately by abc_start() to clock the sequencer)*/
 void pwm_stop(); /*undo pwm_init*/
 uint8_t pwm_is_in_use(); /*0 when stopped or not initialised, non-zero otherwise*/
-void channel_play(uint8_t note, uint8_t duration); /*play a note on the first available channel*/
+void channel_play(uint8_t note, uint16_t duration); /*play a note on the first available channel for duration sequencer ticks*/
+void channel_set_steal_policy(uint8_t policy); /*choose which note channel_play() replaces when all channels are playing*/
+uint16_t channel_stolen_count(); /*number of notes cut short to make room for new ones since abc_start()*/
+uint16_t channel_dropped_count(); /*number of notes that weren't played at all since abc_start()*/
 void channel_stop(uint8_t channel); /*stop the current note*/
 void channel_set_wave(uint8_t channel, uint8_t wave); /*change the wave of the given channel*/
+void pwm_render(); /*render the next block of samples; call this regularly while notes are playing (abc_poll() does it for you)*/
+uint16_t pwm_underruns(); /*number of samples that were missed because pwm_render() wasn't called often enough*/
+#ifdef JPML_BENCHMARK
+uint16_t pwm_benchmark(uint8_t sounding, uint8_t wave); /*cpu cycles to render one sample with the given number of voices (only while the pwm is stopped)*/
+uint16_t pwm_benchmark_mixer(uint8_t sounding, uint8_t mixer); /*cpu cycles the given mixer takes to mix one sample (only while the pwm is stopped)*/
+#endif
 
 /*
  * ABC FUNCTIONS
  * use these to manage playing abc notation files
  */
-FRESULT abc_load_file(char* filename); /*load a given abc file and parse its header*/
-void abc_play(); /*play the currently loaded song*/
+FRESULT abc_load_file(char* filename); /*load a given abc file (or a song compiled by tools/abc2bin) and parse its header*/
+FRESULT abc_index_file(char* filename); /*find every "X:" tune in an abc file (or read the index cached next to it) so they can be loaded by abc_load_tune()*/
+uint8_t abc_tune_count(); /*number of tunes found by abc_index_file()*/
+uint16_t abc_tune_number(uint8_t index); /*"X:" number of the tune at the given index (0 to abc_tune_count()-1)*/
+FRESULT abc_tune_title(uint8_t index, char* buffer, uint8_t size); /*copy the title of the tune at the given index into buffer, cutting it short to fit size bytes*/
+FRESULT abc_load_tune(uint16_t number); /*load the tune with the given "X:" number from the file indexed by abc_index_file(), ready to be played*/
+void abc_play(); /*play the currently loaded song (blocks until it has finished)*/
+void abc_start(); /*start playing the currently loaded song without blocking*/
+uint8_t abc_poll(); /*keep a song started with abc_start() going; call this regularly from the main loop. returns 0 once the song has finished*/
+uint16_t abc_idle_polls(); /*number of calls to abc_poll() that had nothing to do during the last tick*/
+uint32_t abc_drift(); /*total lateness of every tick so far, in 32us timer counts*/
+uint32_t abc_max_lateness(); /*lateness of the latest tick so far, in 32us timer counts*/
+uint8_t abc_queue_depth(); /*number of notes read from the file ahead of time that are waiting to be played*/
+uint8_t abc_queue_high_water(); /*most notes there have been waiting in the queue at once since the song was loaded*/
+uint16_t abc_late_events(); /*number of notes played late because they hadn't been read from the file in time*/
+uint16_t abc_repeat_seeks(); /*number of times the file was seeked back to play a repeated section since the song was loaded*/
+uint32_t abc_seek_time(); /*total time those seeks took (including reading from the new position), in 32us timer counts*/
+FRESULT abc_seek_bar(uint16_t bar); /*carry on from the start of the given bar of the loaded abc song (0 is the start), whether or not it's playing*/
 void abc_stop(); /*stop playing a song*/
 uint8_t abc_is_playing();
-char* abc_song_title(); /*get the title of the currently loaded song*/
+char* abc_song_title(); /*get the title of the currently loaded song ("" if it doesn't have one)*/
+#ifdef JPML_TRACE
+void abc_trace(uint32_t tick, uint8_t type, uint16_t argument, uint8_t voice); /*you supply this: called with every event the sequencer plays (a note, or one of the BIN_ codes in abcbin.h)*/
+#endif
 
 /*
  * SONG FUNCTIONS
@@ -100,5 +170,6 @@ char* abc_song_title(); /*get the title of the currently loaded song*/
  */
 void changeKey(char* keystring); /*set the key signature of the current song (e.g. "Eb", "C#")*/
 void set_tempo(uint16_t bpm); /*set how many crotchets (1/4-notes) should be played per minute*/
+void abc_tempo_ramp(uint16_t bpm, uint16_t ticks); /*change the tempo gradually to bpm crotchets per minute over the given number of sequencer ticks (an accelerando or ritardando)*/
 
 #endif /* _JPML_H */
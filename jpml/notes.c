@@ -0,0 +1,74 @@
+/*
+ * JPML's Polyphonic Music Library
+ * Developed for La Fortuna (at90usb1286) @ 8MHz
+ *
+ * A polyphonic synthesizer and abc player library by jpml1g14.
+ *
+ * notes.c holds the lookup tables declared in notes.h. they live in flash (PROGMEM) rather than being static arrays in the header,
+ * so they don't take up any RAM and there's only ever one copy of them; read them with pgm_read_byte()/pgm_read_word()
+ */
+
+#include "jpml.h"
+#include "notes.h"
+
+/* lookup table: amount to add to a channel's 16-bit phase on each sample, so that a whole cycle of the wave (65536) takes 1/f seconds.
+ * the table is generated by the compiler from SAMPLE_RATE (see jpml.h), so changing F_CPU or PWM_OVERFLOWS_PER_SAMPLE keeps every note in tune.
+ * f is from equal temperament at A4 = 440Hz; at the default 3906.25Hz every note is within 1.5 cents of its true pitch.
+ * notes above the sample rate wrap round (which is what sampling them would do anyway)
+ */
+#define STEP(f) ((uint16_t)(uint32_t)((f) * 65536.0 / SAMPLE_RATE + 0.5))
+const uint16_t note_step[NOTES] PROGMEM = {
+	STEP(27.5000), STEP(29.1352), STEP(30.8677), /*A0-B0*/
+	STEP(32.7032), STEP(34.6478), STEP(36.7081), STEP(38.8909), STEP(41.2034), STEP(43.6535), STEP(46.2493), STEP(48.9994), STEP(51.9131), STEP(55.0000), STEP(58.2705), STEP(61.7354), /*C1-B1*/
+	STEP(65.4064), STEP(69.2957), STEP(73.4162), STEP(77.7817), STEP(82.4069), STEP(87.3071), STEP(92.4986), STEP(97.9989), STEP(103.8262), STEP(110.0000), STEP(116.5409), STEP(123.4708), /*C2-B2*/
+	STEP(130.8128), STEP(138.5913), STEP(146.8324), STEP(155.5635), STEP(164.8138), STEP(174.6141), STEP(184.9972), STEP(195.9977), STEP(207.6523), STEP(220.0000), STEP(233.0819), STEP(246.9417), /*C3-B3*/
+	STEP(261.6256), STEP(277.1826), STEP(293.6648), STEP(311.1270), STEP(329.6276), STEP(349.2282), STEP(369.9944), STEP(391.9954), STEP(415.3047), STEP(440.0000), STEP(466.1638), STEP(493.8833), /*C4-B4*/
+	STEP(523.2511), STEP(554.3653), STEP(587.3295), STEP(622.2540), STEP(659.2551), STEP(698.4565), STEP(739.9888), STEP(783.9909), STEP(830.6094), STEP(880.0000), STEP(932.3275), STEP(987.7666), /*C5-B5*/
+	STEP(1046.5023), STEP(1108.7305), STEP(1174.6591), STEP(1244.5079), STEP(1318.5102), STEP(1396.9129), STEP(1479.9777), STEP(1567.9817), STEP(1661.2188), STEP(1760.0000), STEP(1864.6550), STEP(1975.5332), /*C6-B6*/
+	STEP(2093.0045), STEP(2217.4610), STEP(2349.3181), STEP(2489.0159), STEP(2637.0205), STEP(2793.8259), STEP(2959.9554), STEP(3135.9635), STEP(3322.4376), STEP(3520.0000), STEP(3729.3101), STEP(3951.0664), /*C7-B7*/
+	STEP(4186.0090) /*C8*/
+};
+
+/* the following five arrays are indexed in the order {0, 1, 2, 3, 4, 5, 6} -> {A, B, C, D, E, F, G} */
+
+const uint8_t C_MAJOR[7] PROGMEM = {A4, B4, C4, D4, E4, F4, G4}; /*c major scale, from which all other key signatures are constructed*/
+
+/*indexes of c major to decrement to create a flattened key signature */
+const uint8_t Cb_MAJOR[7] PROGMEM = {1, 4, 0, 3, 6, 2, 5}; 
+
+/*indexes of c major to increment to create a sharpened key signature */
+const uint8_t Cs_MAJOR[7] PROGMEM = {5, 2, 6, 3, 0, 4, 1};
+
+/*which index of the flat array to start iterating downwards from. in order: Ab, Bb, Cb, Db, Eb, F, Gb*/
+const uint8_t flat_signatures[7] PROGMEM = {3, 1, 6, 4, 2, 0, 5}; 
+
+/*which index of the flat array to start iterating downwards from. in order: A, B, C#, D, E, F#, G*/
+const uint8_t sharp_signatures[7] PROGMEM = {2, 4, 6, 1, 3, 5, 0};
+
+/*e.g. to construct the Bb key signature:
+	let key = C_MAJOR
+	let x = flat_signatures[1] (1 because B is the second key alphabetically); this gives 1
+	while x > 0 {
+		key[Cb_MAJOR[x]]--
+		x--
+	}
+*/
+
+/*what each character means to the abc note reader in jpml.c (see notes.h); anything not listed is CHAR_OTHER*/
+const uint8_t abc_char_class[128] PROGMEM = {
+	['\0'] = CHAR_END_OF_LINE, ['%'] = CHAR_END_OF_LINE,
+	['/'] = CHAR_LENGTH, ['0'] = CHAR_LENGTH, ['1'] = CHAR_LENGTH, ['2'] = CHAR_LENGTH, ['3'] = CHAR_LENGTH,
+	['4'] = CHAR_LENGTH, ['5'] = CHAR_LENGTH, ['6'] = CHAR_LENGTH, ['7'] = CHAR_LENGTH, ['8'] = CHAR_LENGTH, ['9'] = CHAR_LENGTH,
+	['A'] = CHAR_NOTE, ['B'] = CHAR_NOTE, ['C'] = CHAR_NOTE, ['D'] = CHAR_NOTE, ['E'] = CHAR_NOTE, ['F'] = CHAR_NOTE, ['G'] = CHAR_NOTE,
+	['a'] = CHAR_NOTE_HIGH, ['b'] = CHAR_NOTE_HIGH, ['c'] = CHAR_NOTE_HIGH, ['d'] = CHAR_NOTE_HIGH,
+	['e'] = CHAR_NOTE_HIGH, ['f'] = CHAR_NOTE_HIGH, ['g'] = CHAR_NOTE_HIGH,
+	[','] = CHAR_OCTAVE_DOWN, ['\''] = CHAR_OCTAVE_UP,
+	['_'] = CHAR_FLAT, ['^'] = CHAR_SHARP, ['='] = CHAR_NATURAL,
+	[' '] = CHAR_SEPARATOR,
+	['['] = CHAR_CHORD_START, [']'] = CHAR_CHORD_END,
+	['z'] = CHAR_REST, ['x'] = CHAR_REST,
+	['-'] = CHAR_TIE,
+	['<'] = CHAR_BROKEN, ['>'] = CHAR_BROKEN,
+	['('] = CHAR_TUPLET,
+	['|'] = CHAR_BAR, [':'] = CHAR_BAR,
+};
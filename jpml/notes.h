@@ -4,28 +4,19 @@
  *
  * A polyphonic synthesizer and abc player library by jpml1g14.
  *
- * notes.h contains data to do with note generation; separated out from jpml.h for readability 
+ * notes.h contains data to do with note generation and reading notes from abc files; separated out from jpml.h for readability 
  */
 
 
 #ifndef _JPML_NOTES_H
 #define _JPML_NOTES_H
 
-/* lookup table: amount to increment channel note timer by on each tick of ISR1
- * hand-calculated in excel based on the clock frequency.
- * sounds good enough for the note range typically found in music but is much less accurate at lower pitches...
- */
-static uint16_t note_step[88] = {
-	3, 4, 4, /*A0-B0*/
-	4, 4, 4, 5, 5, 5, 6, 6, 6, 7, 7, 8, /*C1-B1*/
-	8, 9, 9, 10, 10, 11, 12, 12, 13, 14, 15, 16, /*C2-B2*/
-	17, 18, 19, 20, 21, 22, 24, 25, 27, 28, 30, 32, /*C3-B3*/
-	34, 36, 38, 40, 43, 45, 48, 51, 54, 57, 61, 64, /*C4-B4*/
-	68, 72, 76, 81, 86, 91, 96, 102, 108, 115, 122, 129, /*C5-B5*/
-	137, 145, 153, 163, 172, 183, 193, 205, 217, 230, 244, 258, /*C6-B6*/
-	274, 290, 307, 326, 345, 366, 387, 411, 435, 461, 488, 517, /*C7-B7*/
-	548 /*C8*/
-};
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+/* lookup table (in flash): amount to add to a channel's 16-bit phase on each sample; see notes.c */
+#define NOTES 88 /*number of entries in note_step; note indexes from here up aren't playable*/
+extern const uint16_t note_step[NOTES] PROGMEM;
 
 /* readable constants for each note's index in the above note_step array */
 #define A0 	0
@@ -116,29 +107,34 @@ static uint16_t note_step[88] = {
 #define Bb7	85
 #define B7 	86
 
-/* the following five arrays are indexed in the order {0, 1, 2, 3, 4, 5, 6} -> {A, B, C, D, E, F, G} */
-
-static uint8_t C_MAJOR[7] = {A4, B4, C4, D4, E4, F4, G4}; /*c major scale, from which all other key signatures are constructed*/
-
-/*indexes of c major to decrement to create a flattened key signature */
-static uint8_t Cb_MAJOR[7] = {1, 4, 0, 3, 6, 2, 5}; 
+/* the following five arrays (in flash) are indexed in the order {0, 1, 2, 3, 4, 5, 6} -> {A, B, C, D, E, F, G}; see notes.c */
+extern const uint8_t C_MAJOR[7] PROGMEM; /*c major scale, from which all other key signatures are constructed*/
+extern const uint8_t Cb_MAJOR[7] PROGMEM; /*indexes of c major to decrement to create a flattened key signature*/
+extern const uint8_t Cs_MAJOR[7] PROGMEM; /*indexes of c major to increment to create a sharpened key signature*/
+extern const uint8_t flat_signatures[7] PROGMEM; /*which index of the flat array to start iterating downwards from*/
+extern const uint8_t sharp_signatures[7] PROGMEM; /*which index of the sharp array to start iterating downwards from*/
 
-/*indexes of c major to increment to create a sharpened key signature */
-static uint8_t Cs_MAJOR[7] = {5, 2, 6, 3, 0, 4, 1};
-
-/*which index of the flat array to start iterating downwards from. in order: Ab, Bb, Cb, Db, Eb, F, Gb*/
-static uint8_t flat_signatures[7] = {3, 1, 6, 4, 2, 0, 5}; 
-
-/*which index of the flat array to start iterating downwards from. in order: A, B, C#, D, E, F#, G*/
-static uint8_t sharp_signatures[7] = {2, 4, 6, 1, 3, 5, 0};
-
-/*e.g. to construct the Bb key signature:
-	let key = C_MAJOR
-	let x = flat_signatures[1] (1 because B is the second key alphabetically); this gives 1
-	while x > 0 {
-		key[Cb_MAJOR[x]]--
-		x--
-	}
-*/
+/* lookup table (in flash) of what each character means to the abc note reader, indexed by its ascii code; see notes.c.
+ * the reader looks each character up once and switches on the class, rather than comparing it against every possibility in turn
+ */
+#define CHAR_OTHER 0 /*not part of a note*/
+#define CHAR_LENGTH 1 /*a digit or '/' (note length)*/
+#define CHAR_NOTE 2 /*A-G*/
+#define CHAR_NOTE_HIGH 3 /*a-g*/
+#define CHAR_OCTAVE_DOWN 4 /*','*/
+#define CHAR_OCTAVE_UP 5 /*'\''*/
+#define CHAR_FLAT 6 /*'_'*/
+#define CHAR_SHARP 7 /*'^'*/
+#define CHAR_NATURAL 8 /*'='*/
+#define CHAR_END_OF_LINE 9 /*end of a line ('\0') or the start of a comment ('%')*/
+#define CHAR_SEPARATOR 10 /*' '*/
+#define CHAR_CHORD_START 11 /*'['*/
+#define CHAR_CHORD_END 12 /*']'*/
+#define CHAR_REST 13 /*'z' or 'x'*/
+#define CHAR_TIE 14 /*'-'*/
+#define CHAR_BROKEN 15 /*'<' or '>' (broken rhythm)*/
+#define CHAR_TUPLET 16 /*'(' (a tuplet, or a slur)*/
+#define CHAR_BAR 17 /*'|' or ':' (a bar line, which can be a repeat mark)*/
+extern const uint8_t abc_char_class[128] PROGMEM;
 
 #endif /* _JPML_NOTES_H */
\ No newline at end of file
@@ -0,0 +1,757 @@
+/*
+ * JPML's Polyphonic Music Library
+ * Developed for La Fortuna (at90usb1286) @ 8MHz
+ *
+ * A polyphonic synthesizer and abc player library by jpml1g14.
+ *
+ * abc2bin compiles an abc file into the binary format described in abcbin.h, so that all the parsing is done on the build machine
+ * and the La Fortuna only has to read a few bytes per note. it runs on the build machine: "make tools" builds it as _build/abc2bin
+ *
+ * usage: abc2bin song.abc song.jpb [X]
+ *
+ * the parser follows the one in jpml.c character for character, so a compiled song plays the same as the abc file it came from
+ * (as long as abc2bin and the player are built with the same TICKS_PER_WHOLE).
+ * like abc_load_file() it compiles the first tune of the file, or like abc_load_tune() the one with the "X:" number X, up to the next "X:" line.
+ * each "V:" voice's music gets its own timeline, and the voices are merged here (marked with BIN_VOICE events)
+ */
+
+#define _POSIX_C_SOURCE 200809L /*for getline()*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include "jpml.h"
+#include "abcbin.h"
+
+#define MAX_VOICES 16
+#define VOICE_NAME_SIZE 16
+
+/*one event of the compiled song*/
+struct Event{
+	uint32_t time; /*tick the event happens at*/
+	uint32_t order; /*position in the abc file; keeps events on the same tick in the order they were written*/
+	uint8_t voice;
+	uint8_t type; /*a note index, BIN_WAVE or BIN_END*/
+	uint16_t arg; /*duration of a note in ticks, or (channel << 4) | wave*/
+};
+
+/*the lines of music belonging to one voice*/
+struct Voice{
+	char name[VOICE_NAME_SIZE]; /*whatever follows "V:", up to the first space*/
+	char** lines;
+	size_t line_count;
+	size_t line_capacity;
+};
+
+struct Event* events = 0;
+size_t event_count = 0;
+size_t event_capacity = 0;
+uint32_t event_order = 0;
+struct Voice voices[MAX_VOICES];
+uint8_t voice_count = 0;
+
+/* song information (from headers) */
+char title[BIN_TITLE_SIZE];
+uint16_t tempo = 0; /*beats per minute, or 0 if there was no Q: line*/
+uint16_t tempo_beat = TICKS_PER_WHOLE / 4; /*length of a beat in ticks*/
+uint16_t header_note_length = TICKS_PER_WHOLE / 4;
+uint8_t header_key[7] = {A4, B4, C4, D4, E4, F4, G4};
+
+/* parser state; these are the same as the variables of the same names in jpml.c */
+#define rest 128
+#define natural 64
+#define chord 32
+#define broken 16
+uint8_t note_flags;
+uint8_t next_note;
+uint32_t length;
+uint16_t time_until_next_note;
+int8_t accidental_shift;
+char numstring[16];
+int8_t number_mode;
+int8_t broken_rhythm;
+int8_t broken_rhythm_next;
+uint8_t tuplet_notes;
+uint8_t tuplet_p, tuplet_q;
+uint8_t tuplet_remainder;
+uint16_t default_note_length;
+uint8_t key_signature[7];
+int16_t current_char;
+char field[BIN_TITLE_SIZE];
+uint32_t now; /*tick the next event read is due at (parse_tick in jpml.c)*/
+uint8_t reading_voice; /*voice being compiled*/
+uint8_t reading_file; /*cleared once the last line of the voice has been read*/
+size_t line_index, char_index; /*position of the next character in the voice's lines*/
+struct Position{
+	size_t line, index;
+} repeat_start; /*repeat_start and repeat_pass are as in jpml.c, with a position in the voice's lines instead of an offset in the file*/
+uint8_t repeat_pass;
+uint8_t repeat_key[7];
+
+/*add an event to the song, growing the list as needed*/
+void add_event(uint32_t time, uint8_t voice, uint8_t type, uint16_t arg){
+	if(event_count==event_capacity){
+		event_capacity = event_capacity ? event_capacity*2 : 256;
+		events = realloc(events, event_capacity*sizeof(struct Event));
+		if(!events){
+			fprintf(stderr, "abc2bin: out of memory\n");
+			exit(1);
+		}
+	}
+	events[event_count].time = time;
+	events[event_count].order = event_order++;
+	events[event_count].voice = voice;
+	events[event_count].type = type;
+	events[event_count].arg = arg;
+	event_count++;
+}
+
+/*find the voice with the given name, adding it if it's new; returns its index*/
+uint8_t find_voice(char* name){
+	uint8_t i;
+	for(i=0;i<voice_count;i++){
+		if(!strcmp(voices[i].name, name)) return i;
+	}
+	if(voice_count==MAX_VOICES){
+		fprintf(stderr, "abc2bin: more than %d voices; the rest are merged into the last one\n", MAX_VOICES);
+		return MAX_VOICES-1;
+	}
+	strcpy(voices[voice_count].name, name);
+	return voice_count++;
+}
+
+/*read the name of a voice from the rest of a "V:" line*/
+uint8_t parse_voice(char* voicestring){
+	char name[VOICE_NAME_SIZE];
+	uint8_t i = 0;
+	while(*voicestring==' ') voicestring++;
+	while(i<VOICE_NAME_SIZE-1 && voicestring[i] && voicestring[i]!=' ' && voicestring[i]!='\r' && voicestring[i]!='\n'){
+		name[i] = voicestring[i];
+		i++;
+	}
+	name[i] = '\0';
+	return find_voice(name);
+}
+
+/*add a line of music to the end of a voice*/
+void add_line(uint8_t voice, char* line){
+	struct Voice* v = &voices[voice];
+	if(v->line_count==v->line_capacity){
+		v->line_capacity = v->line_capacity ? v->line_capacity*2 : 64;
+		v->lines = realloc(v->lines, v->line_capacity*sizeof(char*));
+		if(!v->lines){
+			fprintf(stderr, "abc2bin: out of memory\n");
+			exit(1);
+		}
+	}
+	v->lines[v->line_count++] = strdup(line);
+}
+
+/*convert a string of the form "n/d" for ints n,d into the number of ticks in n/d of unit ticks (as in jpml.c)*/
+uint16_t string_to_note_length(char *str, uint16_t unit){
+	uint8_t i = 0;
+	uint8_t fraction = 0;
+	uint8_t no_numbers_set=1;
+	char current_number_string[4];
+	uint8_t current_number_position=0;
+	uint32_t n=1, d=1;
+	while(str[i]!='\0'){
+		if(str[i]=='/'){
+			fraction++;
+			current_number_string[current_number_position]='\0';
+			n=atoi(current_number_string);
+			if(!n) n=1;
+			current_number_position=0;
+		}else if(str[i] >= '0' && str[i] <= '9'){
+			no_numbers_set=0;
+			if(current_number_position<3) current_number_string[current_number_position++]=str[i];
+		}
+		i++;
+	}
+	current_number_string[current_number_position]='\0';
+	if(fraction){
+		d=current_number_position ? atoi(current_number_string) : 1 << fraction;
+		if(!d) d=1;
+	}else if(!no_numbers_set){
+		n=atoi(current_number_string);
+	}
+	n*=unit;
+	n/=d;
+	return n > 0xFFFF ? 0xFFFF : n;
+}
+
+/*change the key signature used for the notes that follow (as changeKey() in jpml.c)*/
+void change_key(uint8_t* key_signature, char *keystring){
+	uint8_t i, j;
+	j=0;
+	while(keystring[j]<'A' || keystring[j] > 'G'){
+		j++;
+		if(keystring[j]=='\0') return;
+	}
+	for(i=0;i<7;i++){
+		key_signature[i]=pgm_read_byte(&C_MAJOR[i]);
+	}
+	uint8_t key = keystring[j+0];
+	uint8_t modifier = keystring[j+1];
+	if(key=='C'&&modifier!='b'&&modifier!='#') return;
+	if(modifier=='b' || (key=='F' && modifier!='#')){
+		for(i = pgm_read_byte(&flat_signatures[key-'A']);i!=0xFF;i--){
+			key_signature[pgm_read_byte(&Cb_MAJOR[i])]--;
+		}
+	}else{
+		for(i = pgm_read_byte(&sharp_signatures[key-'A']);i!=0xFF;i--){
+			key_signature[pgm_read_byte(&Cs_MAJOR[i])]++;
+		}
+	}
+}
+
+/*work out the tempo from the rest of a "Q:" line, as beats per minute and the length of a beat (as parse_tempo() in jpml.c)*/
+void parse_tempo(char* tempostring, uint16_t* bpm, uint16_t* beat_length){
+	char note_length_string[16];
+	uint8_t i;
+	for(i=0;i<15;i++){
+		if(tempostring[i]=='=' || tempostring[i]=='\0') break;
+		note_length_string[i]=tempostring[i];
+	}
+	note_length_string[i]='\0';
+	if(tempostring[i]=='='){
+		*beat_length = string_to_note_length(note_length_string, TICKS_PER_WHOLE);
+		i++;
+	}else{
+		*beat_length = TICKS_PER_WHOLE / 4;
+		i=0;
+	}
+	*bpm = atoi(tempostring+i);
+}
+
+/*as calculate_tick_length() in jpml.c: timer 0 counts in a tick, for a BIN_TEMPO event*/
+uint16_t tick_length(uint16_t bpm, uint16_t beat_length){
+	uint32_t limit;
+	if(!bpm || !beat_length) return 0xFFFF;
+	limit = TICK_LENGTH(bpm, beat_length);
+	if(limit > 0xFFFF) return 0xFFFF;
+	return limit ? limit : 1;
+}
+
+/*interpret an "I:" tag at the given time (as parse_lf_tag() in jpml.c). the device checks the channel against CHANNELS*/
+void parse_lf_tag(char *tagstring, uint32_t time, uint8_t voice){
+	if(strncmp(tagstring, "lf-wave:", 8)) return;
+	int8_t i=8;
+	while(tagstring[i]<'0' || tagstring[i]>'9'){
+		i++;
+		if(tagstring[i]=='\0') return;
+	}
+	uint8_t channel = tagstring[i]-'0';
+	i++;
+	while(tagstring[i]<'0' || tagstring[i]>'9'){
+		i++;
+		if(tagstring[i]=='\0') return;
+	}
+	uint8_t wave = tagstring[i]-'0';
+	add_event(time, voice, BIN_WAVE, (channel << 4) | (wave & 0x0F));
+}
+
+/*record a note as channel_play() would receive it. notes off the end of the keyboard (and rests) are silent, so they're left out*/
+void emit_note(uint8_t note, uint16_t duration){
+	if(note < NOTES) add_event(now, reading_voice, note, duration);
+}
+
+/* the rest of the parser follows jpml.c line for line, reading the lines of one voice rather than the file */
+
+/*get the next character of the voice; -1 after its last line*/
+int16_t voice_getc(void){
+	struct Voice* voice = &voices[reading_voice];
+	while(line_index < voice->line_count){
+		char c = voice->lines[line_index][char_index];
+		if(c){
+			char_index++;
+			return (uint8_t)c;
+		}
+		line_index++;
+		char_index = 0;
+	}
+	return -1;
+}
+
+/*get the next character of the voice without moving on from it*/
+int16_t voice_peek(void){
+	size_t line = line_index, index = char_index;
+	int16_t c = voice_getc();
+	line_index = line;
+	char_index = index;
+	return c;
+}
+
+/*get the position of current_char (char_offset() in jpml.c)*/
+struct Position char_position(void){
+	struct Position position = {line_index, char_index - 1};
+	return position;
+}
+
+/*carry on reading from the given position (seek_char() in jpml.c)*/
+void seek_char(struct Position position){
+	line_index = position.line;
+	char_index = position.index;
+	current_char = voice_getc();
+}
+
+void next_char(void){
+	current_char = current_char=='\n' ? '\0' : voice_getc();
+}
+
+uint8_t at_field_line(void){
+	return ((current_char>='A' && current_char<='Z') || (current_char>='a' && current_char<='z')) && voice_peek()==':';
+}
+
+void read_field(void){
+	uint8_t i = 0;
+	while(current_char>=0 && current_char!='\n'){
+		if(i<sizeof(field)-1 && current_char!='\r') field[i++] = current_char;
+		current_char = voice_getc();
+	}
+	field[i] = '\0';
+}
+
+void skip_line(void){
+	while(current_char>=0 && current_char!='\n') current_char = voice_getc();
+}
+
+void body_field(void);
+
+void start_line(void){
+	while(1){
+		if(current_char>=0) current_char = voice_getc();
+		if(!at_field_line()) return;
+		read_field();
+		body_field();
+	}
+}
+
+void body_field(void){
+	uint16_t bpm, beat_length;
+	switch(field[0]){
+		case('K'):
+			change_key(key_signature, field+2);
+			break;
+		case('I'):
+			parse_lf_tag(field+2, now, reading_voice);
+			break;
+		case('Q'):
+			parse_tempo(field+2, &bpm, &beat_length);
+			add_event(now, reading_voice, BIN_TEMPO, tick_length(bpm, beat_length));
+			break;
+		default:;
+	}
+}
+
+void read_inline_field(void){
+	uint8_t i = 0;
+	next_char();
+	while(current_char>0 && current_char!=']' && current_char!='\n'){
+		if(i<sizeof(field)-1) field[i++] = current_char;
+		next_char();
+	}
+	field[i] = '\0';
+	if(current_char==']') next_char();
+	body_field();
+}
+
+/*as playNoteIfAvailable() in jpml.c*/
+uint8_t play_note_if_available(void){
+	if(note_flags & rest || (next_note!=0xFF)){
+		uint32_t scaled = 0;
+		if(broken_rhythm > 0){
+			length = (length * ((2 << broken_rhythm) - 1)) >> broken_rhythm;
+		}else if(broken_rhythm < 0){
+			length >>= -broken_rhythm;
+		}
+		if(tuplet_notes){
+			scaled = length * tuplet_q + tuplet_remainder;
+			length = scaled / tuplet_p;
+		}
+		if(length==0) length=1;
+		time_until_next_note = note_flags & rest ? length : (length < time_until_next_note ? length : time_until_next_note);
+		emit_note(next_note + accidental_shift, length);
+		if(!(note_flags & chord)){
+			if(tuplet_notes){
+				tuplet_remainder = --tuplet_notes ? scaled % tuplet_p : 0;
+			}
+			broken_rhythm_next = note_flags & broken ? -broken_rhythm : 0;
+			return 1;
+		}else{
+			next_note = 0xFF;
+			accidental_shift = 0;
+			note_flags &= ~(rest | natural);
+			length=default_note_length;
+		}
+	}
+	return 0;
+}
+
+#define playNoteOrBreak if(play_note_if_available()){ note_read = 1; break; }
+
+void skip_ending(void);
+
+void read_bar(void){
+	uint8_t end_repeat = 0, start_repeat = 0, ending = 0;
+	while(current_char==':'){
+		end_repeat = 1;
+		next_char();
+	}
+	while(current_char=='|') next_char();
+	while(current_char==':'){
+		start_repeat = 1;
+		next_char();
+	}
+	if(current_char=='[' && voice_peek()>='1' && voice_peek()<='9') next_char();
+	if(current_char>='1' && current_char<='9'){
+		ending = current_char - '0';
+		next_char();
+	}
+	if(end_repeat){
+		if(!repeat_pass){
+			repeat_pass = 1;
+			seek_char(repeat_start);
+			memcpy(key_signature, repeat_key, sizeof(key_signature));
+			return;
+		}
+		repeat_pass = 0;
+		repeat_start = char_position();
+		memcpy(repeat_key, key_signature, sizeof(key_signature));
+	}
+	if(start_repeat){
+		repeat_pass = 0;
+		repeat_start = char_position();
+		memcpy(repeat_key, key_signature, sizeof(key_signature));
+	}
+	if(ending==1 && repeat_pass) skip_ending();
+}
+
+void skip_ending(void){
+	while(current_char>=0 && current_char!=':'){
+		if(current_char=='\0'){
+			start_line();
+			continue;
+		}
+		if(current_char=='%') skip_line();
+		if(current_char=='[' && voice_peek()>='H' && voice_peek()<='Z'){
+			while(current_char>0 && current_char!=']') next_char();
+		}
+		next_char();
+	}
+	if(current_char>=0) read_bar();
+}
+
+void read_tuplet(void){
+	tuplet_p = current_char - '0';
+	tuplet_q = (tuplet_p==2 || tuplet_p==4 || tuplet_p==8) ? 3 : 2;
+	tuplet_notes = tuplet_p;
+	tuplet_remainder = 0;
+	next_char();
+	if(current_char!=':') return;
+	next_char();
+	if(current_char>='1' && current_char<='9'){
+		tuplet_q = current_char - '0';
+		next_char();
+	}
+	if(current_char!=':') return;
+	next_char();
+	if(current_char>='1' && current_char<='9'){
+		tuplet_notes = current_char - '0';
+		next_char();
+	}
+}
+
+/*as read_notes() in jpml.c: read the next note (or chord) of the voice, timed at now, and move now on to when the next one is due*/
+void read_notes(void){
+	uint8_t char_class;
+	uint8_t note_read = 0;
+	time_until_next_note=0xFFFF;
+	broken_rhythm = broken_rhythm_next;
+	note_flags = 0;
+	accidental_shift = 0;
+	numstring[0]='\0';
+	length = default_note_length;
+	next_note = 0xFF;
+	number_mode = 0;
+	while(!note_read){
+		if(current_char<0){
+			char_class = CHAR_END_OF_LINE;
+		}else if(current_char<128){
+			char_class = pgm_read_byte(&abc_char_class[current_char]);
+		}else{
+			char_class = CHAR_OTHER;
+		}
+		if(number_mode && char_class!=CHAR_LENGTH){
+			number_mode = 0;
+			length = string_to_note_length(numstring, default_note_length);
+			continue;
+		}
+		switch(char_class){
+			case(CHAR_LENGTH):
+				if(number_mode < (int8_t)sizeof(numstring)-1){
+					numstring[number_mode++]=current_char;
+					numstring[number_mode]='\0';
+				}
+				break;
+			case(CHAR_NOTE):
+				playNoteOrBreak
+				if(note_flags & natural){
+					next_note = pgm_read_byte(&C_MAJOR[current_char - 'A']);
+				}else{
+					next_note = key_signature[current_char - 'A'];
+				}
+				break;
+			case(CHAR_NOTE_HIGH):
+				playNoteOrBreak
+				if(note_flags & natural){
+					next_note = pgm_read_byte(&C_MAJOR[current_char - 'a']) + 12;
+				}else{
+					next_note = key_signature[current_char - 'a']+12;
+				}
+				break;
+			case(CHAR_OCTAVE_DOWN):
+				if(next_note!=0xFF) next_note-=12;
+				break;
+			case(CHAR_OCTAVE_UP):
+				if(next_note!=0xFF) next_note+=12;
+				break;
+			case(CHAR_FLAT):
+				playNoteOrBreak
+				accidental_shift--;
+				break;
+			case(CHAR_SHARP):
+				playNoteOrBreak
+				accidental_shift++;
+				break;
+			case(CHAR_NATURAL):
+				playNoteOrBreak
+				note_flags |= natural;
+				break;
+			case(CHAR_END_OF_LINE):
+				if(current_char=='%') skip_line();
+				start_line();
+				if(current_char<0){
+					add_event(now, reading_voice, BIN_END, 0);
+					reading_file = 0;
+					note_read = 1;
+				}
+				continue;
+			case(CHAR_SEPARATOR):
+				playNoteOrBreak
+				break;
+			case(CHAR_BAR):
+				playNoteOrBreak
+				read_bar();
+				continue;
+			case(CHAR_CHORD_START):
+				playNoteOrBreak
+				if(voice_peek()>='1' && voice_peek()<='9'){
+					read_bar();
+					continue;
+				}
+				if(voice_peek()>='H' && voice_peek()<='Z'){
+					read_inline_field();
+					continue;
+				}
+				note_flags |= chord;
+				break;
+			case(CHAR_CHORD_END):
+				if(note_flags & chord) note_flags &= ~chord;
+				next_char();
+				playNoteOrBreak
+				break;
+			case(CHAR_REST):
+				playNoteOrBreak
+				note_flags |= rest;
+				break;
+			case(CHAR_TIE):
+				break;
+			case(CHAR_BROKEN):
+				if(!(note_flags & chord) && (note_flags & rest || next_note!=0xFF)){
+					if(!(note_flags & broken)){
+						note_flags |= broken;
+						broken_rhythm = 0;
+					}
+					if(current_char=='>'){
+						if(broken_rhythm < 3) broken_rhythm++;
+					}else{
+						if(broken_rhythm > -3) broken_rhythm--;
+					}
+				}
+				break;
+			case(CHAR_TUPLET):
+				playNoteOrBreak
+				next_char();
+				if(current_char>='2' && current_char<='9') read_tuplet();
+				continue;
+			default:
+				playNoteOrBreak
+		}
+		if(!note_read) next_char();
+	}
+	if(reading_file) now += time_until_next_note;
+}
+
+/*turn the lines of one voice into events, reading them one note (or chord) at a time as the player does*/
+void compile_voice(uint8_t v){
+	reading_voice = v;
+	line_index = 0;
+	char_index = 0;
+	now = 0;
+	reading_file = 1;
+	default_note_length = header_note_length;
+	memcpy(key_signature, header_key, sizeof(key_signature));
+	broken_rhythm_next = 0;
+	tuplet_notes = 0;
+	current_char = '\0'; /*starting a line also deals with any K: or I: lines at the start of the voice*/
+	start_line();
+	repeat_start = char_position();
+	memcpy(repeat_key, key_signature, sizeof(key_signature));
+	repeat_pass = 0;
+	while(reading_file) read_notes();
+}
+
+/*read the header of the tune with the given "X:" number (or the first tune if it's negative), then share the lines of its body out between the voices*/
+void read_abc(FILE* in, long tune){
+	char* line = 0;
+	size_t line_size = 0;
+	uint8_t in_header = 1;
+	uint8_t in_tune = tune < 0; /*the first tune starts at the start of the file*/
+	uint8_t seen_tune = 0; /*set once the "X:" line of the tune has been read*/
+	int16_t voice = -1; /*no voice until the first V: line, or the first line of music*/
+	size_t n;
+	while(getline(&line, &line_size, in) > 0){
+		if(line[0]=='X' && line[1]==':'){
+			if(in_tune && (seen_tune || !in_header)) break; /*the start of the next tune*/
+			if(!in_tune) in_tune = atol(line+2)==tune;
+			seen_tune = in_tune;
+			continue;
+		}
+		if(!in_tune) continue;
+		if(in_header && ((isalpha((unsigned char)line[0]) && line[1]==':') || line[0]=='%' || line[1]=='%')){
+			switch(line[0]){
+				case('T'):
+					strncpy(title, line+2, BIN_TITLE_SIZE-1);
+					title[BIN_TITLE_SIZE-1] = '\0';
+					n = strcspn(title, "\r\n");
+					title[n] = '\0';
+					break;
+				case('L'):
+					header_note_length = string_to_note_length(line+2, TICKS_PER_WHOLE);
+					break;
+				case('Q'):
+					parse_tempo(line+2, &tempo, &tempo_beat);
+					break;
+				case('K'):
+					change_key(header_key, line+2);
+					break;
+				case('I'):
+					parse_lf_tag(line+2, 0, 0);
+					break;
+				case('V'):
+					voice = parse_voice(line+2);
+					break;
+				default:;
+			}
+			continue;
+		}
+		in_header = 0;
+		if(line[0]=='V' && line[1]==':'){
+			voice = parse_voice(line+2);
+		}else{
+			if(voice<0) voice = find_voice("");
+			add_line(voice, line);
+		}
+	}
+	free(line);
+}
+
+/*order events by time, then by where they were in the file*/
+int compare_events(const void* a, const void* b){
+	const struct Event* x = a;
+	const struct Event* y = b;
+	if(x->time != y->time) return x->time < y->time ? -1 : 1;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/*write a delta time or event argument: 7 bits per byte, most significant first, top bit set on all but the last byte*/
+void write_number(FILE* out, uint32_t number){
+	uint8_t bytes[5];
+	int8_t n = 0;
+	do{
+		bytes[n++] = number & 0x7F;
+		number >>= 7;
+	}while(number);
+	while(n--) fputc(bytes[n] | (n ? 0x80 : 0), out);
+}
+
+/*write a 2-byte little-endian number*/
+void write_word(FILE* out, uint16_t word){
+	fputc(word & 0xFF, out);
+	fputc(word >> 8, out);
+}
+
+/*write the header and the merged events of every voice*/
+void write_song(FILE* out){
+	size_t i;
+	uint32_t last_time = 0, end_time = 0;
+	uint8_t last_voice = 0; /*players start off in voice 0*/
+	fwrite(BIN_MAGIC, 1, BIN_MAGIC_SIZE, out);
+	fputc(BIN_VERSION, out);
+	write_word(out, TICKS_PER_WHOLE);
+	write_word(out, tempo);
+	write_word(out, tempo_beat);
+	fwrite(title, 1, strlen(title)+1, out);
+	qsort(events, event_count, sizeof(struct Event), compare_events);
+	for(i=0;i<event_count;i++){
+		if(events[i].type==BIN_END){ /*the song ends when its last voice does*/
+			if(events[i].time > end_time) end_time = events[i].time;
+			continue;
+		}
+		if(events[i].voice != last_voice){
+			write_number(out, events[i].time - last_time);
+			fputc(BIN_VOICE, out);
+			write_number(out, events[i].voice);
+			last_voice = events[i].voice;
+			last_time = events[i].time;
+		}
+		write_number(out, events[i].time - last_time);
+		fputc(events[i].type, out);
+		write_number(out, events[i].arg);
+		last_time = events[i].time;
+	}
+	if(end_time < last_time) end_time = last_time;
+	write_number(out, end_time - last_time);
+	fputc(BIN_END, out);
+}
+
+int main(int argc, char** argv){
+	uint8_t v;
+	if(argc != 3 && argc != 4){
+		fprintf(stderr, "usage: %s song.abc song.jpb [X]\n", argv[0]);
+		return 2;
+	}
+	FILE* in = fopen(argv[1], "rb");
+	if(!in){
+		perror(argv[1]);
+		return 1;
+	}
+	read_abc(in, argc == 4 ? atol(argv[3]) : -1);
+	fclose(in);
+	if(argc == 4 && !voice_count){
+		fprintf(stderr, "%s: no music in tune X:%s\n", argv[1], argv[3]);
+		return 1;
+	}
+	for(v=0;v<voice_count;v++) compile_voice(v);
+	FILE* out = fopen(argv[2], "wb");
+	if(!out){
+		perror(argv[2]);
+		return 1;
+	}
+	write_song(out);
+	fprintf(stderr, "%s: %lu events in %u voice(s), %ld bytes\n", argv[2], (unsigned long)event_count, voice_count, ftell(out));
+	fclose(out);
+	return 0;
+}
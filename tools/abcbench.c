@@ -0,0 +1,243 @@
+/*
+ * JPML's Polyphonic Music Library
+ * Developed for La Fortuna (at90usb1286) @ 8MHz
+ *
+ * abcbench loads and plays a song through the real library and FatFs on the build machine, reading it from an image of an
+ * SD card (tools/host/diskimage.c) instead of the card itself. "make tools" builds it as _build/abcbench
+ *
+ * usage: abcbench [-r TICK,TICKS,BPM,AT,BAR] card.img SONG.ABC [sector_us [access_us [X[,X...]]]]
+ *
+ * sector_us is how long each sector takes to come over the bus (1100 by default: 512 bytes at 4MHz, and a little time
+ * between bytes), and access_us how long the card takes to start sending after each read command (500 by default).
+ * X picks a tune from a file with several in it; several X's separated by commas (e.g. 7,2) are loaded and played one after another,
+ * which shows up anything one tune leaves behind for the next. every event the sequencer plays is printed, so the output of two
+ * builds (or of a song and its abc2bin compiled version) can be compared with diff. the timings go to stderr so they don't get in the way.
+ * timer 0 is simulated: its ISR is called once a span, with POLLS_PER_SPAN calls to abc_poll() in between.
+ *
+ * -r checks abc_seek_bar() during a tempo ramp: the song is played through with abc_tempo_ramp(BPM, TICKS) called once the sequencer
+ * reaches TICK, and then played again, going to bar BAR once it reaches AT. whatever the sequencer plays after the seek has to be
+ * the same as the end of the first time through, and at the same tempo (the times between the notes are compared, to within
+ * a span of timer 0 either side, since a tick is noticed when the span it ends in does). it prints which tick the bar was found at
+ * instead of the notes, and fails if it wasn't found. BAR has to start after TICK: going back to before the ramp started cancels it
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "jpml.h"
+#include "abcbin.h"
+#include "diskcache.h"
+#include "diskimage.h"
+#include <avr/io.h>
+
+#define DEFAULT_SECTOR_US 1100
+#define DEFAULT_ACCESS_US 500
+#define POLLS_PER_SPAN 8 /*how often the main loop gets to call abc_poll() each time timer 0 fires*/
+#define MOST_SPANS 50000000UL /*give up on songs that don't end*/
+#define DEFAULT_BPM 90 /*the library's tempo for a song without a "Q:" line, put back before each time -r loads the song*/
+#define SPAN_SLACK 512 /*most two times on the simulated clock can be out by (a span of 256 counts each)*/
+
+void TIMER0_COMPA_vect(void); /*the sequencer clock's ISR; see avr/interrupt.h in tools/host*/
+
+static double seconds(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*an event the sequencer played, kept by -r*/
+struct Played{
+	uint32_t tick, time; /*time is in timer 0 counts since the song started*/
+	uint16_t argument;
+	uint8_t type, voice;
+};
+static struct Played* played; /*every event played, when -r is keeping them rather than printing them*/
+static unsigned long played_count, played_size;
+static uint32_t clock_counts; /*time on the simulated timer 0 since the song started*/
+static int keeping;
+
+void abc_trace(uint32_t tick, uint8_t type, uint16_t argument, uint8_t voice){
+	if(keeping){
+		if(played_count == played_size){
+			played_size = played_size ? played_size * 2 : 4096;
+			played = realloc(played, played_size * sizeof(struct Played));
+		}
+		played[played_count++] = (struct Played){tick, clock_counts, argument, type, voice};
+		return;
+	}
+	if(type < NOTES) printf("%lu note %u length %u voice %u\n", (unsigned long)tick, type, argument, voice);
+	else if(type == BIN_WAVE) printf("%lu wave channel %u wave %u\n", (unsigned long)tick, argument >> 4, argument & 0x0F);
+	else if(type == BIN_TEMPO) printf("%lu tempo %u\n", (unsigned long)tick, argument);
+	else if(type == BIN_END) printf("%lu end\n", (unsigned long)tick);
+	else printf("%lu event %u %u voice %u\n", (unsigned long)tick, type, argument, voice);
+}
+
+/*load the song (or tune, if there is one) for -r, at the tempo it would be loaded at first*/
+static FRESULT load_for_ramp(char* song, char* tune){
+	set_tempo(DEFAULT_BPM);
+	return tune ? abc_load_tune(atoi(tune)) : abc_load_file(song);
+}
+
+/* play the song loaded (with -r) keeping what it plays, ramping the tempo once the sequencer reaches ramp_tick and going to bar once it
+ * reaches seek_tick (if it isn't 0). returns the number of events played before the seek
+ */
+static unsigned long play_ramp(uint32_t ramp_tick, uint16_t ramp_ticks, uint16_t bpm, uint32_t seek_tick, uint16_t bar){
+	unsigned long spans = 0, seeked = 0;
+	int ramped = 0;
+	uint8_t i;
+	played_count = 0;
+	clock_counts = 0;
+	keeping = 1;
+	abc_start();
+	while(abc_is_playing() && spans < MOST_SPANS){
+		clock_counts += OCR0A + 1;
+		TIMER0_COMPA_vect();
+		spans++;
+		for(i=0; i<POLLS_PER_SPAN; i++) abc_poll();
+		if(!ramped && played_count && played[played_count-1].tick >= ramp_tick){
+			abc_tempo_ramp(bpm, ramp_ticks);
+			ramped = 1;
+		}
+		if(seek_tick && !seeked && played_count && played[played_count-1].tick >= seek_tick){
+			seeked = played_count;
+			abc_seek_bar(bar);
+		}
+	}
+	abc_stop();
+	keeping = 0;
+	return seeked;
+}
+
+/*whether the events after the seek are the same as those played straight through from the given one, at the same tempo*/
+static int same_tail(struct Played* through, unsigned long through_count, unsigned long from, struct Played* tail, unsigned long tail_count){
+	unsigned long i;
+	long slack;
+	if(through_count - from != tail_count) return 0;
+	for(i=0; i<tail_count; i++){
+		if(through[from+i].type != tail[i].type || through[from+i].argument != tail[i].argument || through[from+i].voice != tail[i].voice
+			|| through[from+i].tick - through[from].tick != tail[i].tick - tail[0].tick) return 0;
+		slack = (long)(through[from+i].time - through[from].time) - (long)(tail[i].time - tail[0].time);
+		if(slack > SPAN_SLACK || slack < -SPAN_SLACK){
+			fprintf(stderr, "tick %lu after the seek is %ld timer counts out\n", (unsigned long)(tail[i].tick - tail[0].tick), slack);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*-r: check that going to a bar during (or after) a tempo ramp carries on as if the song had been played through to it*/
+static int check_ramp_seek(char* spec, char* song, char* tune){
+	unsigned long ramp_tick, ramp_ticks, bpm, seek_tick, bar, through_count, seeked, from;
+	struct Played* through;
+	FRESULT result = FR_OK;
+	if(sscanf(spec, "%lu,%lu,%lu,%lu,%lu", &ramp_tick, &ramp_ticks, &bpm, &seek_tick, &bar) != 5 || !seek_tick){
+		fprintf(stderr, "-r needs TICK,TICKS,BPM,AT,BAR (AT not 0)\n");
+		return 1;
+	}
+	if(tune) result = abc_index_file(song);
+	if(result == FR_OK) result = load_for_ramp(song, tune);
+	if(result != FR_OK){
+		fprintf(stderr, "couldn't load %s (FatFs error %d)\n", song, result);
+		return 1;
+	}
+	play_ramp(ramp_tick, ramp_ticks, bpm, 0, 0);
+	through = played;
+	through_count = played_count;
+	played = NULL;
+	played_size = 0;
+	load_for_ramp(song, tune);
+	seeked = play_ramp(ramp_tick, ramp_ticks, bpm, seek_tick, bar);
+	if(!seeked || seeked == played_count){
+		fprintf(stderr, "the song finished before tick %lu, or can't be seeked in, or has no bar %lu\n", seek_tick, bar);
+		return 1;
+	}
+	for(from = 0; from < through_count; from++){
+		if(same_tail(through, through_count, from, played + seeked, played_count - seeked)){
+			printf("bar %lu: tick %lu after the seek is tick %lu played straight through\n", bar, (unsigned long)played[seeked].tick,
+				(unsigned long)through[from].tick);
+			return 0;
+		}
+	}
+	fprintf(stderr, "what was played after going to bar %lu isn't the end of the song played straight through\n", bar);
+	return 1;
+}
+
+int main(int argc, char** argv){
+	uint32_t sector_us = DEFAULT_SECTOR_US, access_us = DEFAULT_ACCESS_US;
+	unsigned long spans = 0, sectors, reads;
+	double start, load_time = 0, play_time = 0;
+	char* tunes;
+	char* ramp = NULL;
+	FRESULT result = FR_OK;
+	uint8_t i;
+
+	if(argc > 2 && !strcmp(argv[1], "-r")){
+		ramp = argv[2];
+		argv += 2;
+		argc -= 2;
+	}
+	if(argc < 3 || argc > 6){
+		fprintf(stderr, "usage: %s [-r TICK,TICKS,BPM,AT,BAR] card.img SONG.ABC [sector_us [access_us [X[,X...]]]]\n", argv[0]);
+		return 1;
+	}
+	tunes = argc > 5 ? argv[5] : NULL;
+	if(argc > 3) sector_us = atol(argv[3]);
+	if(argc > 4) access_us = atol(argv[4]);
+	if(diskimage_open(argv[1], sector_us, access_us)){
+		perror(argv[1]);
+		return 1;
+	}
+
+	if(ramp){
+		i = check_ramp_seek(ramp, argv[2], tunes);
+		diskimage_close();
+		return i;
+	}
+
+	if(tunes){
+		start = seconds();
+		result = abc_index_file(argv[2]);
+		load_time += seconds() - start;
+	}
+	do{
+		start = seconds();
+		if(tunes){
+			if(result == FR_OK) result = abc_load_tune(atoi(tunes));
+			tunes = strchr(tunes, ',');
+			if(tunes) tunes++;
+		}else{
+			result = abc_load_file(argv[2]);
+		}
+		load_time += seconds() - start;
+		if(result != FR_OK){
+			fprintf(stderr, "couldn't load %s from %s (FatFs error %d)\n", argv[2], argv[1], result);
+			return 1;
+		}
+		if(!spans){ /*(loading the tunes after the first counts towards playing)*/
+			sectors = diskimage_stats.sectors_read;
+			reads = diskimage_stats.reads;
+		}
+		printf("title %s\n", abc_song_title());
+
+		start = seconds();
+		abc_start();
+		while(abc_is_playing() && spans < MOST_SPANS){
+			TIMER0_COMPA_vect();
+			spans++;
+			for(i=0; i<POLLS_PER_SPAN; i++) abc_poll();
+		}
+		play_time += seconds() - start;
+		abc_stop();
+	}while(tunes && spans < MOST_SPANS);
+
+	fprintf(stderr, "load: %.3fms, %lu sectors in %lu reads\n", load_time * 1e3, sectors, reads);
+	fprintf(stderr, "play: %.3fms, %lu sectors in %lu reads, %lu timer 0 spans\n", play_time * 1e3,
+		diskimage_stats.sectors_read - sectors, diskimage_stats.reads - reads, spans);
+	fprintf(stderr, "sector cache: %lu hits, %lu misses\n", (unsigned long)disk_cache_hits(), (unsigned long)disk_cache_misses());
+	fprintf(stderr, "waited %.3fms for the card; queue high water %u, %u late events, %u repeat seeks\n",
+		diskimage_stats.waited_us / 1e3, abc_queue_high_water(), abc_late_events(), abc_repeat_seeks());
+	diskimage_close();
+	return spans < MOST_SPANS ? 0 : 1;
+}
@@ -0,0 +1,15 @@
+/*
+ * stand-in for avr-libc's <avr/interrupt.h> for the tools. an ISR becomes an ordinary function named after its vector,
+ * which the tool calls whenever it wants that interrupt to happen. there's nothing else running, so sei() and cli() do nothing
+ */
+
+#ifndef _HOST_AVR_INTERRUPT_H
+#define _HOST_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define ISR(vector) void vector(void)
+#define sei()
+#define cli()
+
+#endif /* _HOST_AVR_INTERRUPT_H */
@@ -0,0 +1,70 @@
+/*
+ * stand-in for avr-libc's <avr/io.h> so jpml.c and fatfs/sdmm.c can be compiled by the host's cc for the tools.
+ * only the registers they touch are here, as plain variables defined in tools/host/registers.c. nothing drives the timers;
+ * a tool calls the ISRs itself. tools/host/sdcard.c plays the SPI peripheral and the card on the other end of it: waiting
+ * for SPIF in SPSR clocks SPDR out to the card and leaves the card's reply in SPDR, so every wait has to follow a write
+ * to SPDR (as it does in sdmm.c)
+ */
+
+#ifndef _HOST_AVR_IO_H
+#define _HOST_AVR_IO_H
+
+#include <stdint.h>
+
+extern volatile uint8_t PINB, DDRB, PORTB, DDRC;
+extern volatile uint8_t SPCR, SPSR, SPDR;
+extern volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, TIMSK0, TIFR0;
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+extern volatile uint16_t TCNT1, OCR1A;
+extern volatile uint8_t TCCR3A, TCCR3B, TIMSK3;
+extern volatile uint16_t TCNT3, OCR3A;
+
+#define PB5 5
+#define PC6 6
+
+/*timer 0*/
+#define WGM01 1
+#define CS02 2
+#define CS01 1
+#define CS00 0
+#define OCIE0A 1
+#define OCF0A 1
+
+/*timers 1 and 3*/
+#define COM1A1 7
+#define WGM10 0
+#define WGM12 3
+#define CS10 0
+#define TOIE1 0
+#define COM3A1 7
+#define WGM30 0
+#define WGM32 3
+#define CS30 0
+#define TOIE3 0
+
+/*SPCR*/
+#define SPIE 7
+#define SPE 6
+#define DORD 5
+#define MSTR 4
+#define CPOL 3
+#define CPHA 2
+#define SPR1 1
+#define SPR0 0
+
+/*SPSR*/
+#define SPIF 7
+#define WCOL 6
+#define SPI2X 0
+
+#define _BV(bit) (1 << (bit))
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+
+/*called by every wait on a register; the mock peripheral does whatever the hardware would have done by then*/
+void host_sfr_poll(volatile uint8_t* sfr);
+
+#define loop_until_bit_is_set(sfr, bit) do{ host_sfr_poll(&(sfr)); }while(bit_is_clear(sfr, bit))
+#define loop_until_bit_is_clear(sfr, bit) do{ host_sfr_poll(&(sfr)); }while(bit_is_set(sfr, bit))
+
+#endif /* _HOST_AVR_IO_H */
@@ -0,0 +1,15 @@
+/*
+ * stand-in for avr-libc's <avr/pgmspace.h> so the jpml headers and lookup tables (notes.c) can be compiled by the host's cc for the tools.
+ * there's only one address space on the build machine, so flash is just ordinary memory
+ */
+
+#ifndef _HOST_AVR_PGMSPACE_H
+#define _HOST_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t*)(address))
+#define pgm_read_word(address) (*(const uint16_t*)(address))
+
+#endif /* _HOST_AVR_PGMSPACE_H */
@@ -0,0 +1,106 @@
+/*
+ * JPML's Polyphonic Music Library
+ * Developed for La Fortuna (at90usb1286) @ 8MHz
+ *
+ * a disk image as the card under diskcache.c on the build machine (see diskimage.h). the latency is a busy wait on the monotonic clock
+ * rather than a sleep, because sleeps are far too coarse for the few hundred microseconds a card takes over a sector
+ */
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <time.h>
+#include "diskcache.h"
+#include "diskimage.h"
+
+struct diskimage_stats diskimage_stats;
+
+static FILE* image;
+static uint32_t image_sectors;
+static uint32_t image_sector_us;
+static uint32_t image_access_us;
+static DSTATUS image_status = STA_NOINIT;
+
+int diskimage_open(const char* path, uint32_t sector_us, uint32_t access_us){
+	long size;
+	diskimage_close();
+	image = fopen(path, "r+b");
+	if(!image) return 1;
+	fseek(image, 0, SEEK_END);
+	size = ftell(image);
+	image_sectors = size > 0 ? size / DISKIMAGE_SECTOR : 0;
+	image_sector_us = sector_us;
+	image_access_us = access_us;
+	diskimage_stats = (struct diskimage_stats){0};
+	return 0;
+}
+
+void diskimage_close(void){
+	if(image) fclose(image);
+	image = NULL;
+	image_status = STA_NOINIT;
+}
+
+/*what the card would have spent on a command for count sectors*/
+static void wait_sectors(UINT count){
+	struct timespec now, until;
+	uint64_t wait_ns = ((uint64_t)image_sector_us * count + image_access_us) * 1000;
+	if(!wait_ns) return;
+	clock_gettime(CLOCK_MONOTONIC, &until);
+	until.tv_sec += wait_ns / 1000000000;
+	until.tv_nsec += wait_ns % 1000000000;
+	if(until.tv_nsec >= 1000000000){
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	do{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	}while(now.tv_sec < until.tv_sec || (now.tv_sec == until.tv_sec && now.tv_nsec < until.tv_nsec));
+	diskimage_stats.waited_us += wait_ns / 1000;
+}
+
+DSTATUS drive_status(BYTE drv){
+	if(drv) return STA_NOINIT;
+	return image_status;
+}
+
+DSTATUS drive_initialize(BYTE drv){
+	if(drv) return STA_NOINIT;
+	image_status = image ? 0 : STA_NOINIT;
+	return image_status;
+}
+
+DRESULT drive_read(BYTE drv, BYTE* buff, DWORD sector, UINT count){
+	if(drive_status(drv) & STA_NOINIT) return RES_NOTRDY;
+	if(sector + count > image_sectors) return RES_PARERR;
+	wait_sectors(count);
+	diskimage_stats.reads++;
+	diskimage_stats.sectors_read += count;
+	if(fseek(image, (long)sector * DISKIMAGE_SECTOR, SEEK_SET)) return RES_ERROR;
+	return fread(buff, DISKIMAGE_SECTOR, count, image) == count ? RES_OK : RES_ERROR;
+}
+
+DRESULT drive_write(BYTE drv, const BYTE* buff, DWORD sector, UINT count){
+	if(drive_status(drv) & STA_NOINIT) return RES_NOTRDY;
+	if(sector + count > image_sectors) return RES_PARERR;
+	wait_sectors(count);
+	diskimage_stats.writes++;
+	diskimage_stats.sectors_written += count;
+	if(fseek(image, (long)sector * DISKIMAGE_SECTOR, SEEK_SET)) return RES_ERROR;
+	return fwrite(buff, DISKIMAGE_SECTOR, count, image) == count ? RES_OK : RES_ERROR;
+}
+
+DRESULT drive_ioctl(BYTE drv, BYTE ctrl, void* buff){
+	if(drive_status(drv) & STA_NOINIT) return RES_NOTRDY;
+	switch(ctrl){
+		case CTRL_SYNC:
+			return fflush(image) ? RES_ERROR : RES_OK;
+		case GET_SECTOR_COUNT:
+			*(DWORD*)buff = image_sectors;
+			return RES_OK;
+		case GET_BLOCK_SIZE:
+			*(DWORD*)buff = 128; /*as sdmm.c reports*/
+			return RES_OK;
+		default:
+			return RES_PARERR;
+	}
+}
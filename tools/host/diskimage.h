@@ -0,0 +1,32 @@
+/*
+ * JPML's Polyphonic Music Library
+ * Developed for La Fortuna (at90usb1286) @ 8MHz
+ *
+ * the card driver functions (the drive_ ones in diskcache.h) for the build machine, over an image of a FAT12/16/32 card
+ * (with or without a partition table) rather than sdmm.c and a real card. each read or write waits a set time for the
+ * card to respond to the command, then a set time for each sector, so FatFs and the library run at roughly the speed
+ * they would from a card
+ */
+
+#ifndef DISKIMAGE_H
+#define DISKIMAGE_H
+
+#include <stdint.h>
+
+#define DISKIMAGE_SECTOR 512
+
+/*what has gone through the image since it was opened*/
+struct diskimage_stats{
+	unsigned long reads; /*calls to drive_read; each would be one command to the card*/
+	unsigned long writes; /*calls to drive_write*/
+	unsigned long sectors_read;
+	unsigned long sectors_written;
+	unsigned long waited_us; /*total latency added*/
+};
+
+extern struct diskimage_stats diskimage_stats;
+
+int diskimage_open(const char* path, uint32_t sector_us, uint32_t access_us); /*use the image at path as drive 0, waiting access_us per read or write and sector_us per sector; 0 if it opened*/
+void diskimage_close(void);
+
+#endif /* DISKIMAGE_H */
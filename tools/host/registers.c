@@ -0,0 +1,13 @@
+/*
+ * the registers declared by the stand-in <avr/io.h>, for the tools that compile device code on the build machine
+ */
+
+#include <avr/io.h>
+
+volatile uint8_t PINB, DDRB, PORTB, DDRC;
+volatile uint8_t SPCR, SPSR, SPDR;
+volatile uint8_t TCCR0A, TCCR0B, TCNT0, OCR0A, TIMSK0, TIFR0;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+volatile uint16_t TCNT1, OCR1A;
+volatile uint8_t TCCR3A, TCCR3B, TIMSK3;
+volatile uint16_t TCNT3, OCR3A;
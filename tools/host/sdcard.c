@@ -0,0 +1,281 @@
+/*
+ * JPML's Polyphonic Music Library
+ * Developed for La Fortuna (at90usb1286) @ 8MHz
+ *
+ * a simulated SDHC card in SPI mode, behind mock port B and SPI registers (see sdcard.h and avr/io.h).
+ * it answers the commands sdmm.c sends: CMD0, CMD8, ACMD41, CMD58, CMD9, CMD16, the single and multiple block reads and
+ * writes, CMD12 and ACMD23. anything else, or a bad CRC on CMD0/CMD8, gets an error response and is counted
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include "sdcard.h"
+
+#define CARD_CS 0 /*PB0, low selects the card*/
+#define CARD_SCK 1
+#define CARD_MOSI 2
+
+#define R1_IDLE 0x01
+#define R1_ILLEGAL 0x04
+#define R1_CRC 0x08
+#define R1_ADDRESS 0x20
+#define R1_PARAMETER 0x40
+
+#define TOKEN_SINGLE 0xFE /*starts a data block read, or a CMD24 write*/
+#define TOKEN_MULTIPLE 0xFC /*starts each block of a CMD25 write*/
+#define TOKEN_STOP 0xFD /*ends a CMD25 write*/
+#define DATA_ACCEPTED 0x05
+
+#define ACMD41_POLLS 3 /*how many ACMD41s it takes the card to leave the idle state*/
+
+struct sdcard_stats sdcard_stats;
+
+enum card_mode{
+	CARD_COMMAND, /*waiting for a command frame*/
+	CARD_WRITE_TOKEN, /*waiting for the token that starts a block to write*/
+	CARD_WRITE_DATA /*collecting the block and its CRC*/
+};
+
+static uint8_t* card_data;
+static uint32_t card_sectors;
+static uint8_t card_idle;
+static uint8_t card_app; /*the last command was CMD55*/
+static uint8_t card_polls; /*ACMD41s seen*/
+
+static uint8_t frame[6];
+static uint8_t frame_length;
+
+static uint8_t reply[SDCARD_SECTOR + 32]; /*bytes the card will send out next*/
+static uint16_t reply_length, reply_index;
+
+static uint8_t streaming; /*CMD18 is running*/
+static uint32_t stream_sector;
+
+static enum card_mode mode;
+static uint8_t write_multiple;
+static uint32_t write_sector;
+static uint8_t write_block[SDCARD_SECTOR + 2];
+static uint16_t write_index;
+
+void sdcard_insert(uint8_t* sectors, uint32_t count){
+	card_data = sectors;
+	card_sectors = count;
+	card_idle = 1;
+	card_app = 0;
+	card_polls = 0;
+	frame_length = 0;
+	reply_length = reply_index = 0;
+	streaming = 0;
+	mode = CARD_COMMAND;
+	memset(&sdcard_stats, 0, sizeof(sdcard_stats));
+}
+
+static void send(uint8_t byte){
+	if(reply_length < sizeof(reply)) reply[reply_length++] = byte;
+}
+
+/*start a reply: one byte of NCR, then the R1 response*/
+static void respond(uint8_t r1){
+	reply_length = reply_index = 0;
+	send(0xFF);
+	send(r1);
+	if(r1 & ~R1_IDLE) sdcard_stats.errors++;
+}
+
+/*a data block: a little access time, the start token, the data and a CRC the host ignores*/
+static void send_block(const uint8_t* data, uint16_t length){
+	uint16_t i;
+	send(0xFF);
+	send(0xFF);
+	send(TOKEN_SINGLE);
+	for(i=0; i<length; i++) send(data[i]);
+	send(0x00);
+	send(0x00);
+}
+
+static void send_csd(void){
+	uint8_t csd[16];
+	uint32_t size = card_sectors/1024 - 1; /*C_SIZE counts 512KiB*/
+	memset(csd, 0, sizeof(csd));
+	csd[0] = 0x40; /*CSD version 2.0*/
+	csd[7] = (size >> 16) & 0x3F;
+	csd[8] = size >> 8;
+	csd[9] = size;
+	send_block(csd, sizeof(csd));
+}
+
+static void run_command(void){
+	uint8_t command = frame[0] & 0x3F;
+	uint32_t argument = (uint32_t)frame[1]<<24 | (uint32_t)frame[2]<<16 | (uint32_t)frame[3]<<8 | frame[4];
+	uint8_t app = card_app;
+
+	sdcard_stats.commands++;
+	card_app = 0;
+
+	/*in SPI mode only these two have their CRC checked*/
+	if((command==0 && frame[5]!=0x95) || (command==8 && frame[5]!=0x87)){
+		respond(R1_CRC);
+		return;
+	}
+
+	switch(command){
+		case 0:
+			card_idle = 1;
+			streaming = 0;
+			respond(R1_IDLE);
+			break;
+		case 8:
+			respond(card_idle);
+			send(0x00);
+			send(0x00);
+			send((argument >> 8) & 0x0F);
+			send(argument);
+			break;
+		case 55:
+			card_app = 1;
+			respond(card_idle);
+			break;
+		case 41:
+			if(!app){
+				respond(card_idle | R1_ILLEGAL);
+				break;
+			}
+			if(++card_polls >= ACMD41_POLLS) card_idle = 0;
+			respond(card_idle);
+			break;
+		case 58:
+			respond(card_idle);
+			send(card_idle ? 0x00 : 0xC0); /*powered up, block addressed*/
+			send(0xFF);
+			send(0x80);
+			send(0x00);
+			break;
+		case 9:
+			respond(card_idle);
+			send_csd();
+			break;
+		case 12:
+			streaming = 0;
+			respond(0);
+			break;
+		case 16:
+			respond(argument==SDCARD_SECTOR ? card_idle : R1_PARAMETER);
+			break;
+		case 17:
+		case 18:
+		case 24:
+		case 25:
+			if(card_idle){
+				respond(R1_IDLE | R1_ILLEGAL);
+			}else if(argument >= card_sectors){
+				respond(R1_ADDRESS);
+			}else{
+				respond(0);
+				if(command==17){
+					send_block(card_data + argument*SDCARD_SECTOR, SDCARD_SECTOR);
+					sdcard_stats.sectors_read++;
+				}else if(command==18){
+					streaming = 1;
+					stream_sector = argument;
+				}else{
+					mode = CARD_WRITE_TOKEN;
+					write_multiple = command==25;
+					write_sector = argument;
+				}
+			}
+			break;
+		case 23:
+			respond(app ? card_idle : R1_ILLEGAL);
+			break;
+		default:
+			respond(card_idle | R1_ILLEGAL);
+	}
+}
+
+static void write_byte(uint8_t in){
+	if(mode == CARD_WRITE_TOKEN){
+		if(in == (write_multiple ? TOKEN_MULTIPLE : TOKEN_SINGLE)){
+			mode = CARD_WRITE_DATA;
+			write_index = 0;
+		}else if(in == TOKEN_STOP && write_multiple){
+			mode = CARD_COMMAND;
+			reply_length = reply_index = 0;
+			send(0xFF); /*the byte after the stop token, then busy*/
+			send(0x00);
+			send(0x00);
+		}
+		return;
+	}
+	write_block[write_index++] = in;
+	if(write_index < sizeof(write_block)) return;
+	reply_length = reply_index = 0;
+	if(write_sector < card_sectors){
+		memcpy(card_data + write_sector*SDCARD_SECTOR, write_block, SDCARD_SECTOR);
+		sdcard_stats.sectors_written++;
+		write_sector++;
+		send(DATA_ACCEPTED);
+	}else{
+		send(0x0D); /*write error*/
+		sdcard_stats.errors++;
+	}
+	send(0x00); /*busy while it programs the block*/
+	send(0x00);
+	mode = write_multiple ? CARD_WRITE_TOKEN : CARD_COMMAND;
+}
+
+/*one byte each way: what the card sends was decided before it sees what comes in*/
+static uint8_t exchange(uint8_t in){
+	uint8_t out = 0xFF;
+
+	if(reply_index == reply_length && streaming){
+		reply_length = reply_index = 0;
+		if(stream_sector < card_sectors){
+			send_block(card_data + stream_sector*SDCARD_SECTOR, SDCARD_SECTOR);
+			sdcard_stats.sectors_read++;
+			stream_sector++;
+		}else{
+			streaming = 0;
+		}
+	}
+	if(reply_index < reply_length) out = reply[reply_index++];
+
+	if(mode != CARD_COMMAND){
+		write_byte(in);
+	}else if(frame_length || (in & 0xC0) == 0x40){
+		frame[frame_length++] = in;
+		if(frame_length == sizeof(frame)){
+			frame_length = 0;
+			run_command();
+		}
+	}
+	return out;
+}
+
+/*the SPI peripheral: a wait on SPSR finishes the transfer that writing SPDR started*/
+void host_sfr_poll(volatile uint8_t* sfr){
+	unsigned long divider;
+
+	if(sfr != &SPSR) return;
+	if(!(SPCR & _BV(SPE)) || !(SPCR & _BV(MSTR))){
+		fprintf(stderr, "sdcard: waiting on SPIF without the SPI enabled as master\n");
+		exit(1);
+	}
+	if((DDRB & (_BV(CARD_CS) | _BV(CARD_SCK) | _BV(CARD_MOSI))) != (_BV(CARD_CS) | _BV(CARD_SCK) | _BV(CARD_MOSI))){
+		fprintf(stderr, "sdcard: SS, SCK and MOSI have to be outputs for the SPI to stay master\n");
+		exit(1);
+	}
+
+	if(PORTB & _BV(CARD_CS)){
+		SPDR = 0xFF; /*deselected: the card leaves MISO alone*/
+	}else{
+		divider = 4UL << (2 * (SPCR & (_BV(SPR1) | _BV(SPR0))));
+		if((SPCR & (_BV(SPR1) | _BV(SPR0))) == (_BV(SPR1) | _BV(SPR0))) divider = 128;
+		if(SPSR & _BV(SPI2X)) divider /= 2;
+		if(card_idle && F_CPU/divider > SDCARD_IDENTIFY_HZ) sdcard_stats.fast_while_idle++;
+		SPDR = exchange(SPDR);
+		sdcard_stats.bytes++;
+	}
+	SPSR |= _BV(SPIF);
+}
@@ -0,0 +1,31 @@
+/*
+ * JPML's Polyphonic Music Library
+ * Developed for La Fortuna (at90usb1286) @ 8MHz
+ *
+ * a simulated SDHC card in SPI mode, wired to the mock SPI registers in tools/host/avr/io.h, so sdmm.c built with
+ * SDMM_USE_SPI can be run on the build machine. the card's sectors are an ordinary array owned by the caller
+ */
+
+#ifndef SDCARD_H
+#define SDCARD_H
+
+#include <stdint.h>
+
+#define SDCARD_SECTOR 512
+#define SDCARD_IDENTIFY_HZ 400000UL /*the most a card has to take before it leaves the idle state*/
+
+/*what the card has seen since it was inserted*/
+struct sdcard_stats{
+	unsigned long bytes; /*bytes clocked while the card was selected*/
+	unsigned long commands;
+	unsigned long sectors_read;
+	unsigned long sectors_written;
+	unsigned long fast_while_idle; /*bytes clocked faster than SDCARD_IDENTIFY_HZ before initialisation finished*/
+	unsigned long errors; /*commands the card rejected*/
+};
+
+extern struct sdcard_stats sdcard_stats;
+
+void sdcard_insert(uint8_t* sectors, uint32_t count); /*power the card up over count sectors of data, and clear the stats*/
+
+#endif /* SDCARD_H */
@@ -0,0 +1,12 @@
+/*
+ * stand-in for avr-libc's <util/atomic.h> for the tools: ISRs only run when the tool calls them, so every block is atomic already
+ */
+
+#ifndef _HOST_UTIL_ATOMIC_H
+#define _HOST_UTIL_ATOMIC_H
+
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_FORCEON
+#define ATOMIC_BLOCK(type) for(uint8_t atomic_once = 1; atomic_once; atomic_once = 0)
+
+#endif /* _HOST_UTIL_ATOMIC_H */
@@ -0,0 +1,126 @@
+/*
+ * JPML's Polyphonic Music Library
+ * Developed for La Fortuna (at90usb1286) @ 8MHz
+ *
+ * A polyphonic synthesizer and abc player library by jpml1g14.
+ *
+ * lexbench measures how quickly the abc note reader can classify characters: once with the chain of comparisons jpml.c used to use,
+ * and once with the abc_char_class lookup table from notes.c. it runs on the build machine: "make tools" builds it as _build/lexbench
+ *
+ * usage: lexbench song.abc [more.abc ...]
+ *
+ * every character of every file is classified both ways, and the two have to agree before anything is timed.
+ * the host is much faster than the La Fortuna, so compare the two rates with each other rather than with the device
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "jpml.h"
+#include "notes.h"
+
+#define PASSES_TARGET_SECONDS 0.5 /*roughly how long to time each classifier for*/
+
+/*the chain of comparisons read_notes() made before the lookup table, in the same order (plus the classes added since)*/
+static uint8_t classify_chain(int16_t c){
+	if(c>='/' && c<='9') return CHAR_LENGTH;
+	else if(c>='A' && c<='G') return CHAR_NOTE;
+	else if(c>='a' && c<='g') return CHAR_NOTE_HIGH;
+	else if(c==',') return CHAR_OCTAVE_DOWN;
+	else if(c=='\'') return CHAR_OCTAVE_UP;
+	else if(c=='_') return CHAR_FLAT;
+	else if(c=='^') return CHAR_SHARP;
+	else if(c=='=') return CHAR_NATURAL;
+	else if(c=='\0' || c=='%' || c<0) return CHAR_END_OF_LINE;
+	else if(c==' ') return CHAR_SEPARATOR;
+	else if(c=='|' || c==':') return CHAR_BAR;
+	else if(c=='[') return CHAR_CHORD_START;
+	else if(c==']') return CHAR_CHORD_END;
+	else if(c=='z' || c=='x') return CHAR_REST;
+	else if(c=='-') return CHAR_TIE;
+	else if(c=='<' || c=='>') return CHAR_BROKEN;
+	else if(c=='(') return CHAR_TUPLET;
+	else return CHAR_OTHER;
+}
+
+/*the lookup read_notes() does now*/
+static uint8_t classify_table(int16_t c){
+	if(c<0) return CHAR_END_OF_LINE;
+	else if(c<128) return pgm_read_byte(&abc_char_class[c]);
+	else return CHAR_OTHER;
+}
+
+/*classify the whole corpus with the given classifier; returns a sum of the classes so the work can't be optimised away*/
+static uint32_t run_pass(uint8_t (*classify)(int16_t), const int16_t* corpus, size_t length){
+	uint32_t sum = 0;
+	size_t i;
+	for(i=0; i<length; i++) sum += classify(corpus[i]);
+	return sum;
+}
+
+/*time the given classifier over the corpus and return how many characters it classified per second*/
+static double benchmark(const char* name, uint8_t (*classify)(int16_t), const int16_t* corpus, size_t length){
+	unsigned long passes = 0;
+	uint32_t sum = 0;
+	clock_t start = clock();
+	double seconds;
+	do{
+		sum += run_pass(classify, corpus, length);
+		passes++;
+		seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+	}while(seconds < PASSES_TARGET_SECONDS);
+	printf("%-6s %12.0f chars/s (%lu passes, checksum %lu)\n", name, (double)length * passes / seconds, passes, (unsigned long)sum);
+	return (double)length * passes / seconds;
+}
+
+int main(int argc, char** argv){
+	int16_t* corpus = NULL;
+	size_t length = 0, capacity = 0, i;
+	int arg, c;
+	double chain_rate, table_rate;
+
+	if(argc < 2){
+		fprintf(stderr, "usage: %s song.abc [more.abc ...]\n", argv[0]);
+		return 1;
+	}
+
+	/*read every file into one list of characters, as the reader would see them: line ends become '\0' and each file ends with EOF*/
+	for(arg=1; arg<argc; arg++){
+		FILE* in = fopen(argv[arg], "rb");
+		if(!in){
+			perror(argv[arg]);
+			return 1;
+		}
+		do{
+			c = fgetc(in);
+			if(c=='\r') continue;
+			if(length == capacity){
+				capacity = capacity ? capacity*2 : 4096;
+				corpus = realloc(corpus, capacity * sizeof(int16_t));
+				if(!corpus){
+					fprintf(stderr, "out of memory\n");
+					return 1;
+				}
+			}
+			corpus[length++] = c=='\n' ? '\0' : c==EOF ? -1 : c;
+		}while(c != EOF);
+		fclose(in);
+	}
+
+	for(i=0; i<length; i++){
+		if(classify_chain(corpus[i]) != classify_table(corpus[i])){
+			fprintf(stderr, "classifiers disagree on character %d\n", corpus[i]);
+			return 1;
+		}
+	}
+
+	printf("%lu characters from %d file(s)\n", (unsigned long)length, argc-1);
+	chain_rate = benchmark("chain", classify_chain, corpus, length);
+	table_rate = benchmark("table", classify_table, corpus, length);
+	printf("table is %.2fx the speed of the chain\n", table_rate / chain_rate);
+
+	free(corpus);
+	return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * JPML's Polyphonic Music Library
+ * Developed for La Fortuna (at90usb1286) @ 8MHz
+ *
+ * sdmmcheck runs fatfs/sdmm.c, built for the SPI peripheral (SDMM_USE_SPI), against a simulated card on the build machine.
+ * the port B and SPI registers are mocks (tools/host/avr/io.h) and the card answers through them (tools/host/sdcard.c), so
+ * this exercises the real transfer code byte for byte. "make tools" builds it as _build/sdmmcheck
+ *
+ * usage: sdmmcheck
+ *
+ * it initialises the card, reads and writes single and multiple sectors against a known pattern, and prints what was
+ * clocked over the bus. it exits with 1 on the first thing that goes wrong
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "diskio.h"
+#include "sdcard.h"
+
+#define CARD_SECTORS 4096UL /*2MiB*/
+#define MOST_SECTORS 8 /*longest multiple sector transfer to try*/
+
+static uint8_t* card;
+
+static uint8_t pattern(uint32_t sector, uint16_t offset, uint8_t seed){
+	return (uint8_t)(sector*31 + offset*7 + (offset>>8) + seed);
+}
+
+static void fill(uint8_t* buffer, uint32_t sector, uint16_t count, uint8_t seed){
+	uint16_t i;
+	for(i=0; i<count*SDCARD_SECTOR; i++) buffer[i] = pattern(sector + i/SDCARD_SECTOR, i%SDCARD_SECTOR, seed);
+}
+
+static void fail(const char* what, uint32_t sector, uint16_t count){
+	fprintf(stderr, "%s failed at sector %lu (count %u)\n", what, (unsigned long)sector, count);
+	exit(1);
+}
+
+/*read count sectors from sector, and check they hold the pattern made with seed*/
+static void check_read(uint32_t sector, uint16_t count, uint8_t seed){
+	static uint8_t buffer[MOST_SECTORS*SDCARD_SECTOR], expected[MOST_SECTORS*SDCARD_SECTOR];
+	if(disk_read(0, buffer, sector, count) != RES_OK) fail("disk_read", sector, count);
+	fill(expected, sector, count, seed);
+	if(memcmp(buffer, expected, count*SDCARD_SECTOR)) fail("disk_read data", sector, count);
+}
+
+/*write count sectors of the pattern made with seed, and check they reached the card*/
+static void check_write(uint32_t sector, uint16_t count, uint8_t seed){
+	static uint8_t buffer[MOST_SECTORS*SDCARD_SECTOR];
+	fill(buffer, sector, count, seed);
+	if(disk_write(0, buffer, sector, count) != RES_OK) fail("disk_write", sector, count);
+	if(memcmp(card + sector*SDCARD_SECTOR, buffer, count*SDCARD_SECTOR)) fail("disk_write data", sector, count);
+}
+
+int main(void){
+	static const uint32_t starts[] = {0, 1, 511, 2047, CARD_SECTORS - MOST_SECTORS};
+	uint8_t buffer[SDCARD_SECTOR];
+	DWORD sectors;
+	unsigned long bytes;
+	uint16_t count;
+	uint8_t i;
+
+	card = malloc(CARD_SECTORS * SDCARD_SECTOR);
+	if(!card){
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for(sectors=0; sectors<CARD_SECTORS; sectors++) fill(card + sectors*SDCARD_SECTOR, sectors, 1, 0);
+	sdcard_insert(card, CARD_SECTORS);
+
+	if(disk_initialize(0)){
+		fprintf(stderr, "disk_initialize failed\n");
+		return 1;
+	}
+	if(sdcard_stats.fast_while_idle){
+		fprintf(stderr, "%lu bytes were clocked faster than %luHz while the card was idle\n", sdcard_stats.fast_while_idle, SDCARD_IDENTIFY_HZ);
+		return 1;
+	}
+	if(disk_ioctl(0, GET_SECTOR_COUNT, &sectors) != RES_OK || sectors != CARD_SECTORS){
+		fprintf(stderr, "disk_ioctl(GET_SECTOR_COUNT) gave %lu sectors, not %lu\n", (unsigned long)sectors, CARD_SECTORS);
+		return 1;
+	}
+	printf("initialised: %lu commands, %lu bytes\n", sdcard_stats.commands, sdcard_stats.bytes);
+
+	bytes = sdcard_stats.bytes;
+	if(disk_read(0, buffer, 0, 1) != RES_OK) fail("disk_read", 0, 1);
+	printf("one sector read: %lu bytes on the bus\n", sdcard_stats.bytes - bytes);
+
+	for(i=0; i<sizeof(starts)/sizeof(starts[0]); i++)
+		for(count=1; count<=MOST_SECTORS; count++) check_read(starts[i], count, 0);
+	for(i=0; i<sizeof(starts)/sizeof(starts[0]); i++)
+		for(count=1; count<=MOST_SECTORS; count++){
+			check_write(starts[i], count, count);
+			check_read(starts[i], count, count);
+		}
+
+	if(disk_read(0, buffer, CARD_SECTORS, 1) == RES_OK){
+		fprintf(stderr, "disk_read past the end of the card succeeded\n");
+		return 1;
+	}
+	if(sdcard_stats.errors != 1){
+		fprintf(stderr, "the card rejected %lu commands, expected only the read past the end\n", sdcard_stats.errors);
+		return 1;
+	}
+
+	printf("%lu sectors read, %lu written, %lu commands, %lu bytes: all good\n",
+		sdcard_stats.sectors_read, sdcard_stats.sectors_written, sdcard_stats.commands, sdcard_stats.bytes);
+	free(card);
+	return 0;
+}
@@ -0,0 +1,153 @@
+/*
+ * JPML's Polyphonic Music Library
+ * Developed for La Fortuna (at90usb1286) @ 8MHz
+ *
+ * seekbench measures how long FatFs takes to seek in a fragmented file, following the FAT chain as it used to and with the
+ * cluster link map the player now makes for the song file (see use_link_map() in jpml.c). it runs on the build machine
+ * over an image of a card (tools/host/diskimage.c): "make tools" builds it as _build/seekbench
+ *
+ * usage: seekbench card.img [sector_us [access_us]]
+ *
+ * card.img has to be a formatted FAT image with a few MB free (e.g. made with "mkfs.fat -C card.img 32768"); use a copy, as
+ * the test files are written to it (and deleted again afterwards). each file is written in SEEK_FRAGMENTS pieces with
+ * another file's cluster between them, so it is as fragmented as a link map of SEEK_FRAGMENTS fragments can cope with.
+ * then SEEKS seeks to spread out offsets are made each way, each followed by reading a byte, and the time they took
+ * (mostly the time the simulated card took) and sectors read are averaged
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "jpml.h"
+#include "diskcache.h"
+#include "diskimage.h"
+
+#define DEFAULT_SECTOR_US 1100
+#define DEFAULT_ACCESS_US 500
+#define SEEKS 64
+#define SMALLEST_KB 16
+#define LARGEST_KB 1024
+
+static double seconds(void){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*write size bytes to name in SEEK_FRAGMENTS pieces, with a cluster of filler written in between each piece*/
+static FRESULT write_fragmented(const char* name, const char* filler_name, uint32_t size, uint32_t cluster){
+	static uint8_t block[512];
+	FIL file, filler;
+	FRESULT result;
+	UINT written;
+	uint32_t piece = (size / SEEK_FRAGMENTS + cluster - 1) / cluster * cluster, done = 0, i;
+
+	result = f_open(&file, name, FA_CREATE_ALWAYS | FA_WRITE);
+	if(result == FR_OK) result = f_open(&filler, filler_name, FA_CREATE_ALWAYS | FA_WRITE);
+	while(result == FR_OK && done < size){
+		for(i=0; i<piece && done<size && result==FR_OK; i+=sizeof(block), done+=sizeof(block)){
+			memset(block, (uint8_t)(done / sizeof(block)), sizeof(block));
+			result = f_write(&file, block, sizeof(block), &written);
+		}
+		if(result == FR_OK) result = f_sync(&file); /*so the next cluster the filler takes is after this piece*/
+		for(i=0; i<cluster && result==FR_OK; i+=sizeof(block)) result = f_write(&filler, block, sizeof(block), &written);
+		if(result == FR_OK) result = f_sync(&filler);
+	}
+	f_close(&filler);
+	f_close(&file);
+	return result;
+}
+
+/*count the fragments of an open file by making a link map big enough for any of the files here*/
+static unsigned count_fragments(FIL* file){
+	static DWORD map[2 * (LARGEST_KB * 2) + 2]; /*(a cluster is at least 512 bytes)*/
+	map[0] = sizeof(map) / sizeof(map[0]);
+	file->cltbl = map;
+	f_lseek(file, CREATE_LINKMAP);
+	file->cltbl = 0;
+	return (map[0] - 2) / 2;
+}
+
+/*seek to SEEKS offsets in the file and read a byte at each; gives the average milliseconds and sectors read per seek*/
+static void time_seeks(FIL* file, uint32_t size, double* ms, double* sectors){
+	unsigned long sectors_before = diskimage_stats.sectors_read;
+	double start = seconds();
+	uint8_t byte;
+	UINT read;
+	uint32_t i;
+	for(i=0; i<SEEKS; i++){
+		uint32_t offset = (uint32_t)((uint64_t)size * ((i * 37) % SEEKS) / SEEKS); /*every SEEKSth of the file, in a jumbled order*/
+		f_lseek(file, offset);
+		f_read(file, &byte, 1, &read);
+	}
+	*ms = (seconds() - start) * 1e3 / SEEKS;
+	*sectors = (double)(diskimage_stats.sectors_read - sectors_before) / SEEKS;
+}
+
+int main(int argc, char** argv){
+	static FATFS fs;
+	DWORD link_map[SEEK_FRAGMENTS*2 + 2];
+	uint32_t sector_us = DEFAULT_SECTOR_US, access_us = DEFAULT_ACCESS_US, cluster, kb;
+	unsigned long sectors;
+	double start, chain_ms, chain_sectors, seek_ms, seek_sectors, map_ms;
+	FRESULT result;
+	FIL file;
+
+	if(argc < 2 || argc > 4){
+		fprintf(stderr, "usage: %s card.img [sector_us [access_us]]\n", argv[0]);
+		return 1;
+	}
+	if(argc > 2) sector_us = atol(argv[2]);
+	if(argc > 3) access_us = atol(argv[3]);
+	if(diskimage_open(argv[1], 0, 0)){ /*no latency while the files are written*/
+		perror(argv[1]);
+		return 1;
+	}
+	result = f_mount(&fs, "", 1);
+	if(result != FR_OK){
+		fprintf(stderr, "couldn't mount %s (FatFs error %d)\n", argv[1], result);
+		return 1;
+	}
+	cluster = (uint32_t)fs.csize * 512;
+	printf("FAT%s, %lu byte clusters, link map of %u fragments (%u bytes)\n",
+		fs.fs_type==FS_FAT12 ? "12" : fs.fs_type==FS_FAT16 ? "16" : "32", (unsigned long)cluster, SEEK_FRAGMENTS, (unsigned)sizeof(link_map));
+	printf("%7s %9s %32s %29s %23s\n", "size", "fragments", "per seek, following the FAT", "per seek, with the map", "making the map");
+
+	for(kb=SMALLEST_KB; kb<=LARGEST_KB; kb*=4){
+		result = write_fragmented("SEEKTEST.BIN", "SEEKFILL.BIN", kb * 1024, cluster);
+		if(result != FR_OK){
+			fprintf(stderr, "couldn't write a %luKB file (FatFs error %d); is the image full?\n", (unsigned long)kb, result);
+			break;
+		}
+		diskimage_close();
+		diskimage_open(argv[1], sector_us, access_us);
+		f_mount(&fs, "", 1); /*start with nothing cached*/
+		if(f_open(&file, "SEEKTEST.BIN", FA_READ) != FR_OK) break;
+		time_seeks(&file, kb * 1024, &chain_ms, &chain_sectors);
+
+		sectors = diskimage_stats.sectors_read;
+		start = seconds();
+		link_map[0] = sizeof(link_map) / sizeof(link_map[0]);
+		file.cltbl = link_map;
+		result = f_lseek(&file, CREATE_LINKMAP);
+		map_ms = (seconds() - start) * 1e3;
+		sectors = diskimage_stats.sectors_read - sectors;
+		if(result == FR_OK) time_seeks(&file, kb * 1024, &seek_ms, &seek_sectors);
+
+		printf("%5luKB %9u %19.3fms %6.2f sectors", (unsigned long)kb, count_fragments(&file), chain_ms, chain_sectors);
+		if(result == FR_OK) printf(" %13.3fms %6.2f sectors %9.3fms %3lu sectors", seek_ms, seek_sectors, map_ms, sectors);
+		else printf("  (too many fragments for the map)");
+		printf("\n");
+		f_close(&file);
+		diskimage_close();
+		diskimage_open(argv[1], 0, 0);
+		f_mount(&fs, "", 1);
+	}
+
+	f_unlink("SEEKTEST.BIN");
+	f_unlink("SEEKFILL.BIN");
+	diskimage_close();
+	return 0;
+}